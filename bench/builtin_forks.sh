@@ -0,0 +1,51 @@
+#!/bin/sh
+# In-process builtins: runs ITER iterations of a loop body made of echo,
+# printf, test, [, true, false, pwd and printenv, once as builtins and once
+# as the equivalent external programs, and reports processes created per
+# 1000 commands (from the kernel's fork counter in /proc/stat) and time.
+#
+#   sh bench/builtin_forks.sh [ITER]
+
+ITER=${1:-10000}
+. "$(dirname "$0")/common.sh"
+
+forks() {
+    awk '/^processes/ { print $2 }' /proc/stat
+}
+
+# $1 = label, $2 = prefix for external commands ("" for builtins)
+run() {
+    x=$2
+    : > "$TMP/script"
+    i=0
+    while [ $i -lt "$ITER" ]; do
+        cat >> "$TMP/script" <<EOF
+${x}echo line \$i
+${x}printf %s:%d\\n name $i
+${x}test -d /tmp
+${x}[ $i -ge 0 ]
+${x}true
+${x}false
+${x}pwd
+${x}printenv HOME
+EOF
+        i=$((i + 1))
+    done
+    cmds=$((ITER * 8))
+
+    before=$(forks)
+    start=$(date +%s%N)
+    "$MYSHELL" "$TMP/script" > /dev/null
+    end=$(date +%s%N)
+    after=$(forks)
+
+    # The shell itself and the two date calls around it are not counted
+    awk -v l="$1" -v n="$cmds" -v f="$((after - before - 3))" -v ns="$((end - start))" 'BEGIN {
+        if (f < 0) f = 0
+        printf "%-9s %d commands in %.3f s, %.0f forks per 1k commands, %.0f commands/sec\n",
+            l, n, ns / 1e9, f * 1000 / n, n / (ns / 1e9)
+    }'
+}
+
+run builtin ""
+run external /usr/bin/env\ 
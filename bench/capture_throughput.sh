@@ -0,0 +1,32 @@
+#!/bin/sh
+# Command substitution: captures MB megabytes (default 1024) with
+# x=$(cat ...) and compares it with the same cat sent to /dev/null, then
+# times 10000 captures of a builtin (no fork) against an external echo.
+#
+#   sh bench/capture_throughput.sh [MB]
+
+MB=${1:-1024}
+. "$(dirname "$0")/common.sh"
+
+# Four copies of one file make up the total; no NUL bytes so the value is whole
+PART=$((MB / 4))
+head -c $((PART * 1048576)) /dev/urandom | tr '\000' x > "$TMP/part"
+FILES=$(for i in 1 2 3 4; do printf '%s ' "$TMP/part"; done)
+
+seconds() {
+    start=$(date +%s.%N)
+    "$@" > /dev/null
+    end=$(date +%s.%N)
+    awk "BEGIN { print $end - $start }"
+}
+
+t_null=$(seconds "$MYSHELL" -c "cat $FILES > /dev/null")
+t_capture=$(seconds "$MYSHELL" -c "x=\$(cat $FILES)")
+printf 'cat > /dev/null   %6d MB  %8.0f MB/s\n' $((PART * 4)) "$(awk "BEGIN { print $PART * 4 / $t_null }")"
+printf 'x=$(cat)          %6d MB  %8.0f MB/s\n' $((PART * 4)) "$(awk "BEGIN { print $PART * 4 / $t_capture }")"
+
+for cmd in 'echo hi' '/bin/echo hi'; do
+    for i in $(seq 10000); do printf 'x=$(%s)\n' "$cmd"; done > "$TMP/script"
+    t=$(seconds "$MYSHELL" "$TMP/script")
+    printf 'x=$(%s)%*s %8.0f per second\n' "$cmd" $((12 - ${#cmd})) '' "$(awk "BEGIN { print 10000 / $t }")"
+done
@@ -0,0 +1,8 @@
+# Setup shared by the bench/*.sh scripts, which source it: $MYSHELL is the
+# shell as bench/Makefile builds it, and $TMP a scratch directory removed
+# on exit.
+BENCH=$(cd "$(dirname "$0")" && pwd)
+make -s -C "$BENCH" myshell >&2 || exit 1
+MYSHELL="$BENCH/myshell"
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
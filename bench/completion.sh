@@ -0,0 +1,40 @@
+#!/bin/sh
+# Tab completion: puts EXECS executables (default 20000) in four PATH
+# directories, then times building the trie on first use and 1000 command
+# completions with compgen, which runs the same code as Tab. Also checks
+# that a new executable is picked up through inotify without a rescan.
+#
+#   sh bench/completion.sh [EXECS]
+
+EXECS=${1:-20000}
+. "$(dirname "$0")/common.sh"
+
+for d in 1 2 3 4; do
+    mkdir "$TMP/bin$d"
+    (cd "$TMP/bin$d" && seq -f "tool$d-%.0f" $((EXECS / 4)) | xargs touch &&
+        seq -f "tool$d-%.0f" $((EXECS / 4)) | xargs chmod +x)
+done
+
+# Prefixes matching one name, about 1100 names, and all of them
+{
+    echo "time compgen -c tool1-1 > /dev/null"
+    echo "stats -r"
+    for i in $(seq 1000); do echo "compgen -c tool2-$i > /dev/null"; done
+    echo "stats compgen"
+    echo "stats -r"
+    for i in $(seq 100); do echo "compgen -c tool3-1 > /dev/null"; done
+    echo "stats compgen"
+    echo "stats -r"
+    for i in $(seq 100); do echo "compgen -c > /dev/null"; done
+    echo "stats compgen"
+    echo "/usr/bin/touch $TMP/bin4/fresh-tool"
+    echo "/bin/chmod +x $TMP/bin4/fresh-tool"
+    echo "compgen -c fresh"
+} > "$TMP/script"
+
+PATH="$TMP/bin1:$TMP/bin2:$TMP/bin3:$TMP/bin4" "$MYSHELL" "$TMP/script" 2>&1 |
+    awk -v n="$EXECS" '
+        /^real/ { print "first Tab (build trie, " n " executables):", $2 }
+        /^compgen/ { label = ++k == 1 ? "one match" : k == 2 ? "~1100 matches" : "all matches"
+                     print "completion, " label ": mean", $3, "p99", $5 }
+        /^fresh/ { print "new executable seen through inotify:", $1 }'
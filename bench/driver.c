@@ -0,0 +1,271 @@
+// Benchmark driver: runs reproducible workloads against a built shell and
+// prints the results as one JSON object, so runs can be compared over time.
+//
+//   ./driver [-s scale] [path/to/myshell] > results.json
+//
+// Workloads are generated into a temporary directory. Every number comes from
+// the shell binary itself; nothing here links against the shell's code.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+extern char** environ;
+
+const char* shell = "./myshell";
+char workdir[] = "/tmp/myshell-bench-XXXXXX";
+double scale = 1;
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+long scaled(long n) {
+    long v = (long)(n * scale);
+    return v > 0 ? v : 1;
+}
+
+char* work_path(const char* name) {
+    static char path[4][256];
+    static int next = 0;
+    char* p = path[next++ & 3];
+    snprintf(p, sizeof(path[0]), "%s/%s", workdir, name);
+    return p;
+}
+
+// Run the shell with the given arguments, stdin from infile (or /dev/null)
+// and stdout discarded. Returns the elapsed seconds.
+double run_shell(char** args, const char* infile) {
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, infile ? infile : "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&fa, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+
+    char* argv[8] = { (char*)shell };
+    for (int i = 0; args[i] != NULL && i < 6; i++) argv[i + 1] = args[i];
+    double start = now();
+    pid_t pid;
+    int err = posix_spawn(&pid, shell, &fa, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    if (err != 0) {
+        fprintf(stderr, "driver: %s: %s\n", shell, strerror(err));
+        exit(1);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    return now() - start;
+}
+
+// Write count copies of a line made by fmt(i) into a file
+void write_lines(const char* path, long count, const char* fmt) {
+    FILE* f = fopen(path, "w");
+    if (f == NULL) {
+        perror(path);
+        exit(1);
+    }
+    for (long i = 0; i < count; i++) fprintf(f, fmt, i, i);
+    fclose(f);
+}
+
+int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+// An interactive-style session over pipes: write one command, wait for its
+// output, repeat. Measures the latency the user sees per command.
+typedef struct {
+    pid_t pid;
+    int to;
+    int from;
+} Session;
+
+Session session_start() {
+    int in[2], out[2];
+    if (pipe(in) < 0 || pipe(out) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa, in[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&fa, out[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addclose(&fa, in[1]);
+    posix_spawn_file_actions_addclose(&fa, out[0]);
+    char* argv[] = { (char*)shell, NULL };
+    Session s;
+    int err = posix_spawn(&s.pid, shell, &fa, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    if (err != 0) {
+        fprintf(stderr, "driver: %s: %s\n", shell, strerror(err));
+        exit(1);
+    }
+    close(in[0]);
+    close(out[1]);
+    s.to = in[1];
+    s.from = out[0];
+    return s;
+}
+
+// Send cmd and block until a line equal to "." comes back
+double session_round_trip(Session* s, const char* cmd) {
+    char buf[256];
+    size_t len = strlen(cmd);
+    double start = now();
+    if (write(s->to, cmd, len) != (ssize_t)len) exit(1);
+    for (;;) {
+        ssize_t n = read(s->from, buf, sizeof(buf));
+        if (n <= 0) {
+            fprintf(stderr, "driver: shell went away\n");
+            exit(1);
+        }
+        if (n >= 2 && buf[n - 2] == '.' && buf[n - 1] == '\n') break;
+    }
+    return now() - start;
+}
+
+void session_end(Session* s) {
+    close(s->to);
+    close(s->from);
+    waitpid(s->pid, NULL, 0);
+}
+
+// Empty-command round trips: a builtin that prints the marker, per second
+void bench_round_trip() {
+    long count = scaled(20000);
+    Session s = session_start();
+    double total = 0;
+    for (long i = 0; i < count; i++) total += session_round_trip(&s, "echo .\n");
+    session_end(&s);
+    printf("  \"round_trip\": { \"count\": %ld, \"per_sec\": %.0f, \"mean_us\": %.2f },\n",
+           count, count / total, total / count * 1e6);
+}
+
+// execute() latency: an external command followed by the marker, so each
+// sample covers one fork/exec and the wait for it
+void bench_exec_latency() {
+    long count = scaled(2000);
+    double* samples = malloc(sizeof(double) * count);
+    Session s = session_start();
+    session_round_trip(&s, "/bin/true\necho .\n");  // warm the PATH cache
+    for (long i = 0; i < count; i++) samples[i] = session_round_trip(&s, "/bin/true\necho .\n");
+    session_end(&s);
+    qsort(samples, count, sizeof(double), compare_double);
+    printf("  \"exec_latency_us\": { \"count\": %ld, \"p50\": %.1f, \"p90\": %.1f, "
+           "\"p99\": %.1f, \"max\": %.1f },\n", count, samples[count / 2] * 1e6,
+           samples[count * 9 / 10] * 1e6, samples[count * 99 / 100] * 1e6,
+           samples[count - 1] * 1e6);
+    free(samples);
+}
+
+// handle_pipe(): bytes through a 4-stage cat pipeline
+void bench_pipe() {
+    long mb = scaled(512);
+    char* data = work_path("data");
+    int fd = open(data, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    char* block = calloc(1, 1 << 20);
+    for (long i = 0; i < mb; i++) {
+        if (write(fd, block, 1 << 20) != 1 << 20) exit(1);
+    }
+    close(fd);
+    free(block);
+
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "cat %s | cat | cat | cat > /dev/null", data);
+    char* args[] = { "-c", cmd, NULL };
+    double t = run_shell(args, NULL);
+    unlink(data);
+    printf("  \"pipe\": { \"stages\": 4, \"mb\": %ld, \"mb_per_sec\": %.0f },\n", mb, mb / t);
+}
+
+// tokenize(): a script of eight-word lines, parsed once and run as a no-op
+// builtin; the same number of empty lines is timed and subtracted
+void bench_tokenize() {
+    long count = scaled(1000000);
+    write_lines(work_path("words.sh"), count, "true alpha beta gamma %ld delta epsilon %ld\n");
+    write_lines(work_path("empty.sh"), count, "true\n");
+    char* words[] = { work_path("words.sh"), NULL };
+    char* empty[] = { work_path("empty.sh"), NULL };
+    double t = run_shell(words, NULL) - run_shell(empty, NULL);
+    if (t <= 0) t = 1e-9;
+    printf("  \"tokenize\": { \"lines\": %ld, \"words_per_line\": 8, \"lines_per_sec\": %.0f },\n",
+           count, count / t);
+}
+
+// Builtin dispatch: lines of `true` read from stdin, minus empty lines
+void bench_builtin() {
+    long count = scaled(1000000);
+    write_lines(work_path("true.in"), count, "true\n");
+    write_lines(work_path("blank.in"), count, "\n");
+    double t = run_shell((char*[]){ NULL }, work_path("true.in"));
+    double base = run_shell((char*[]){ NULL }, work_path("blank.in"));
+    printf("  \"builtin_dispatch\": { \"count\": %ld, \"ns_per_call\": %.1f },\n",
+           count, (t - base) / count * 1e9);
+}
+
+// Variable store: distinct names set, then read back through expansion
+void bench_variables() {
+    long count = scaled(200000);
+    write_lines(work_path("set.sh"), count, "v%ld=value%ld\n");
+    FILE* f = fopen(work_path("get.sh"), "w");
+    for (long i = 0; i < count; i++) fprintf(f, "v%ld=value\n", i);
+    for (long i = 0; i < count; i++) fprintf(f, "true $v%ld\n", i);
+    fclose(f);
+    write_lines(work_path("base.sh"), count, "true v%ld\n");
+
+    char* set[] = { work_path("set.sh"), NULL };
+    char* get[] = { work_path("get.sh"), NULL };
+    char* base[] = { work_path("base.sh"), NULL };
+    double t_set = run_shell(set, NULL);
+    double t_get = run_shell(get, NULL) - t_set - run_shell(base, NULL);
+    if (t_get <= 0) t_get = 1e-9;
+    printf("  \"variables\": { \"count\": %ld, \"set_per_sec\": %.0f, \"get_per_sec\": %.0f }\n",
+           count, count / t_set, count / t_get);
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "s:")) != -1) {
+        if (opt == 's') scale = atof(optarg);
+        else {
+            fprintf(stderr, "usage: %s [-s scale] [myshell]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (optind < argc) shell = argv[optind];
+    if (access(shell, X_OK) != 0) {
+        fprintf(stderr, "driver: %s: %s\n", shell, strerror(errno));
+        return 1;
+    }
+    if (mkdtemp(workdir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("{\n  \"shell\": \"%s\",\n  \"timestamp\": %ld,\n  \"scale\": %g,\n",
+           shell, (long)time(NULL), scale);
+    bench_round_trip();
+    bench_exec_latency();
+    bench_pipe();
+    bench_tokenize();
+    bench_builtin();
+    bench_variables();
+    printf("}\n");
+
+    const char* files[] = { "words.sh", "empty.sh", "true.in", "blank.in", "set.sh",
+                            "get.sh", "base.sh", NULL };
+    for (int i = 0; files[i] != NULL; i++) unlink(work_path(files[i]));
+    rmdir(workdir);
+    return 0;
+}
@@ -0,0 +1,27 @@
+#!/bin/sh
+# Exec cost with a large environment: ENVVARS exported variables of 64 bytes
+# each, then COUNT runs of /bin/true. First with the environment unchanged,
+# so every exec reuses the cached envp, then with an export before each
+# command, so every exec follows a rebuild. Latencies come from `stats`.
+#
+#   sh bench/env_exec.sh [COUNT] [ENVVARS]
+
+COUNT=${1:-5000}
+ENVVARS=${2:-5000}
+. "$(dirname "$0")/common.sh"
+
+VALUE=$(head -c 64 /dev/zero | tr '\0' x)
+awk -v n="$ENVVARS" -v v="$VALUE" 'BEGIN { for (i = 0; i < n; i++) print "export E" i "=" v }' > "$TMP/env"
+
+for mode in cached rebuilt; do
+    cp "$TMP/env" "$TMP/cmds"
+    echo "stats -r" >> "$TMP/cmds"
+    if [ $mode = cached ]; then
+        yes /bin/true | head -n "$COUNT" >> "$TMP/cmds"
+    else
+        awk -v n="$COUNT" 'BEGIN { for (i = 0; i < n; i++) print "export CHANGED=" i "\n/bin/true" }' >> "$TMP/cmds"
+    fi
+    echo "stats /bin/true" >> "$TMP/cmds"
+    "$MYSHELL" < "$TMP/cmds" | awk -v m="$mode" -v n="$COUNT" -v e="$ENVVARS" '
+        $1 == "/bin/true" { printf "%-8s %d vars, %d execs, mean %s, p50 %s, p99 %s\n", m, e, n, $3, $4, $5 }'
+done
@@ -0,0 +1,31 @@
+#!/bin/sh
+# Glob expansion: FILES files (default 500000) in one directory, matched by
+# *.log with and without sorting, then the same number spread over 1000
+# directories and matched by **/*.log. bash's times are shown for reference.
+#
+#   sh bench/glob_expand.sh [FILES]
+
+FILES=${1:-500000}
+. "$(dirname "$0")/common.sh"
+
+mkdir "$TMP/flat" "$TMP/tree"
+cd "$TMP/flat" && seq -f 'f%.0f.log' "$FILES" | xargs touch
+cd "$TMP/tree" && seq 1000 | xargs mkdir -p
+for d in $(seq 1000); do
+    seq -f "$d/f%.0f.log" $((FILES / 1000)); done | xargs touch
+
+# The time keyword covers expanding the words; echo is a builtin, so the
+# matches are never copied into an exec
+cd "$TMP/flat"
+printf 'time echo *.log > /dev/null\nset +o globsort\ntime echo *.log > /dev/null\n' |
+    "$MYSHELL" 2>&1 | awk -v n="$FILES" '/^real/ { print (++k == 1 ? "*.log sorted  " : "*.log unsorted"), n, "files", $2 }'
+cd "$TMP/tree"
+printf 'time echo **/*.log > /dev/null\n' |
+    "$MYSHELL" 2>&1 | awk -v n="$FILES" -v j="$(nproc)" '/^real/ { print "**/*.log      ", n, "files", $2, "(" j " CPUs)" }'
+
+if command -v bash > /dev/null; then
+    cd "$TMP/flat"
+    bash -c 'TIMEFORMAT="bash *.log     %3Rs"; time echo *.log > /dev/null'
+    cd "$TMP/tree"
+    bash -O globstar -c 'TIMEFORMAT="bash **/*.log  %3Rs"; time echo **/*.log > /dev/null'
+fi
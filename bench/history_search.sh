@@ -0,0 +1,57 @@
+#!/bin/sh
+# History search latency: builds an ENTRIES-line history file, then times
+# QUERIES Ctrl-R style searches (`history -s`) and inline-suggestion lookups
+# (`history -p`) against it, one- and two-byte queries included. The one-off
+# cost of loading and indexing the file is measured separately and
+# subtracted from the per-query figures.
+#
+#   sh bench/history_search.sh [ENTRIES] [QUERIES]
+
+ENTRIES=${1:-1000000}
+QUERIES=${2:-20000}
+. "$(dirname "$0")/common.sh"
+export HISTFILE="$TMP/history"
+export HISTSIZE="$ENTRIES"
+
+awk -v n="$ENTRIES" 'BEGIN {
+    srand(1)
+    split("git commit -m|make -j8|ssh deploy@host|grep -rn pattern|tail -f /var/log/app|kubectl get pods -n", verbs, "|")
+    for (i = 0; i < n; i++) printf "%s %d\n", verbs[int(rand() * 6) + 1], int(rand() * 100000)
+}' > "$TMP/entries"
+
+# Best of three runs, each against a fresh copy of the history file
+time_run() {
+    best=
+    for run in 1 2 3; do
+        cp "$TMP/entries" "$HISTFILE"
+        start=$(date +%s%N)
+        "$MYSHELL" < "$1" > /dev/null
+        end=$(date +%s%N)
+        ns=$((end - start))
+        if [ -z "$best" ] || [ "$ns" -lt "$best" ]; then best=$ns; fi
+    done
+    echo "$best"
+}
+
+echo "history -s host" > "$TMP/warm"
+awk -v q="$QUERIES" 'BEGIN {
+    srand(2)
+    split("host|pods -n|commit -m 4|var/log/app 9|pattern 12|zq|8", terms, "|")
+    for (i = 0; i < q; i++) printf "history -s %s\n", terms[int(rand() * 7) + 1]
+}' > "$TMP/search"
+awk -v q="$QUERIES" 'BEGIN {
+    srand(3)
+    split("git|make -j8 1|ssh deploy@host 5|tail -f /var|kubectl get|k|zq", terms, "|")
+    for (i = 0; i < q; i++) printf "history -p %s\n", terms[int(rand() * 7) + 1]
+}' > "$TMP/suggest"
+
+warm=$(time_run "$TMP/warm")
+search=$(time_run "$TMP/search")
+suggest=$(time_run "$TMP/suggest")
+
+awk -v e="$ENTRIES" -v q="$QUERIES" -v w="$warm" -v s="$search" -v p="$suggest" 'BEGIN {
+    printf "entries: %d\n", e
+    printf "load + index: %.1f ms\n", w / 1e6
+    printf "search latency: %.1f us/query\n", (s - w) / q / 1e3
+    printf "suggest latency: %.1f us/query\n", (p - w) / q / 1e3
+}'
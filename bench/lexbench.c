@@ -0,0 +1,106 @@
+// Lexer benchmark: the span lexer (scalar, SSE2 and AVX2 scans) against the
+// word-copying tokenizer it replaced, over the same generated lines.
+//
+//   make -C bench lex        (or: cc -O2 -o lexbench lexbench.c)
+//
+// The shell is compiled in with its main() renamed, so this measures the
+// real lex_line(). The old tokenizer is kept below as the baseline; like the
+// old parse_line() it first splits the line on `|` and copies every word.
+#define main shell_main
+#include "../version6.c"
+#undef main
+
+#define OLD_MAXARGS 10
+
+char** old_tokenize(Arena* a, char* cmdline) {
+    if (cmdline[0] == '\0') return NULL;
+    char** arglist = arena_alloc(a, sizeof(char*) * (OLD_MAXARGS + 1));
+    int argnum = 0;
+    char* cp = cmdline;
+    while (*cp != '\0' && argnum < OLD_MAXARGS) {
+        while (*cp == ' ' || *cp == '\t') cp++;
+        if (*cp == '\0') break;
+        char* start = cp;
+        while (*cp != '\0' && *cp != ' ' && *cp != '\t') {
+            if (*cp == '`' || (cp[0] == '$' && cp[1] == '(')) cp = (char*)skip_substitution(cp);
+            else cp++;
+        }
+        arglist[argnum++] = arena_strndup(a, start, cp - start);
+    }
+    arglist[argnum] = NULL;
+    return arglist;
+}
+
+char* old_find_pipe(char* s) {
+    while (*s != '\0') {
+        if (*s == '|') return s;
+        if (*s == '`' || (s[0] == '$' && s[1] == '(')) s = (char*)skip_substitution(s);
+        else s++;
+    }
+    return NULL;
+}
+
+// Returns the number of words, so the work cannot be optimized away
+size_t old_split(Arena* a, char* line) {
+    size_t words = 0;
+    char* segment = line;
+    for (;;) {
+        char* bar = old_find_pipe(segment);
+        if (bar != NULL) *bar = '\0';
+        char** argv = old_tokenize(a, segment);
+        while (argv != NULL && argv[words] != NULL) words++;
+        if (bar == NULL) return words;
+        segment = bar + 1;
+    }
+}
+
+double seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Three shapes of line, all within the old tokenizer's ten words per stage
+const char* shapes[] = {
+    "ls -l",
+    "grep -n 'some pattern' notes.txt | sort -k2 | uniq -c > counts.txt",
+    "cp /usr/share/doc/example-package/examples/configuration/defaults.conf "
+    "/home/someone/projects/a-fairly-long-directory-name/config/defaults.conf.backup",
+};
+
+int main(int argc, char** argv) {
+    long lines = argc > 1 ? atol(argv[1]) : 2000000;
+    const char* isa_names[] = { "scalar", "sse2", "avx2" };
+    int have_avx2 = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    have_avx2 = __builtin_cpu_supports("avx2");
+#endif
+    printf("%-10s %-8s %12s %10s\n", "line", "lexer", "ns/line", "MB/s");
+    for (int s = 0; s < 3; s++) {
+        size_t len = strlen(shapes[s]);
+        char* line = malloc(len + 1);
+        for (int impl = -1; impl <= LEX_AVX2; impl++) {
+            if (impl == LEX_AVX2 && !have_avx2) continue;
+            lex_isa = impl < 0 ? LEX_SCALAR : impl;
+            size_t sink = 0;
+            double start = seconds();
+            for (long i = 0; i < lines; i++) {
+                memcpy(line, shapes[s], len + 1);
+                if (impl < 0) {
+                    sink += old_split(&cmd_arena, line);
+                } else {
+                    size_t count;
+                    lex_line(&cmd_arena, line, len, &count);
+                    sink += count;
+                }
+                if ((i & 1023) == 0) arena_reset(&cmd_arena);
+            }
+            double t = seconds() - start;
+            printf("%-10s %-8s %12.1f %10.0f%s\n", s == 0 ? "short" : s == 1 ? "pipeline" : "long",
+                   impl < 0 ? "old" : isa_names[impl], t / lines * 1e9, len * lines / t / 1e6,
+                   sink == 0 ? " (no words?)" : "");
+        }
+        free(line);
+    }
+    return 0;
+}
@@ -0,0 +1,17 @@
+#!/bin/sh
+# parallel builtin: runs ITEMS CPU-bound items (each hashes 20 MB of zeros)
+# with -j 1 and with -j <online CPUs>, and prints the builtin's own report
+# of wall time and CPU utilization for both.
+#
+#   sh bench/parallel_speedup.sh [ITEMS]
+
+ITEMS=${1:-32}
+. "$(dirname "$0")/common.sh"
+
+printf 'head -c 20000000 /dev/zero | sha256sum\n' > "$TMP/work"
+seq "$ITEMS" > "$TMP/items"
+
+for j in 1 "$(nproc)"; do
+    printf 'parallel -j %s sh %s < %s > /dev/null\n' "$j" "$TMP/work" "$TMP/items" |
+        "$MYSHELL"
+done
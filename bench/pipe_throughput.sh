@@ -0,0 +1,28 @@
+#!/bin/sh
+# Pipeline throughput: pushes SIZE_MB megabytes through 2-, 4- and 8-stage
+# `cat | cat | ...` pipelines run by the shell and reports MB/s for each.
+#
+#   sh bench/pipe_throughput.sh [SIZE_MB]
+
+SIZE_MB=${1:-1024}
+. "$(dirname "$0")/common.sh"
+
+head -c "$((SIZE_MB * 1024 * 1024))" /dev/zero > "$TMP/data"
+
+for stages in 2 4 8; do
+    line="cat $TMP/data"
+    i=1
+    while [ "$i" -lt "$stages" ]; do
+        line="$line | cat"
+        i=$((i + 1))
+    done
+    echo "$line > /dev/null" > "$TMP/cmd"
+
+    start=$(date +%s%N)
+    "$MYSHELL" < "$TMP/cmd" > /dev/null
+    end=$(date +%s%N)
+
+    awk -v s="$stages" -v mb="$SIZE_MB" -v ns="$((end - start))" 'BEGIN {
+        printf "%d stages: %d MB in %.3f s, %.0f MB/s\n", s, mb, ns / 1e9, mb / (ns / 1e9)
+    }'
+done
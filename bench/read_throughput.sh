@@ -0,0 +1,18 @@
+#!/bin/sh
+# Line-reader throughput: feeds LINES assignment lines (handled in-process,
+# so no fork per line) through stdin and reports lines/second.
+#
+#   sh bench/read_throughput.sh [LINES]
+
+LINES=${1:-10000000}
+. "$(dirname "$0")/common.sh"
+
+yes 'x=1' | head -n "$LINES" > "$TMP/input"
+
+start=$(date +%s%N)
+"$MYSHELL" < "$TMP/input" > /dev/null
+end=$(date +%s%N)
+
+awk -v n="$LINES" -v ns="$((end - start))" 'BEGIN {
+    printf "lines: %d\nseconds: %.3f\nlines/sec: %.0f\n", n, ns / 1e9, n / (ns / 1e9)
+}'
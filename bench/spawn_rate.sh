@@ -0,0 +1,33 @@
+#!/bin/sh
+# Launch-backend microbenchmark: runs COUNT short external commands
+# (/bin/true) with each `launcher` backend and reports spawns/second, first
+# from a fresh shell and then after BLOAT variables of 1 KB each have grown
+# the shell's memory. fork slows down as the shell grows; spawn and the
+# zygote fork server should not.
+#
+#   sh bench/spawn_rate.sh [COUNT] [BLOAT]
+
+COUNT=${1:-20000}
+BLOAT=${2:-200000}
+. "$(dirname "$0")/common.sh"
+
+VALUE=$(head -c 1024 /dev/zero | tr '\0' x)
+i=0
+while [ $i -lt "$BLOAT" ]; do
+    echo "bloat$i=$VALUE"
+    i=$((i + 1))
+done > "$TMP/bloat"
+yes /bin/true | head -n "$COUNT" > "$TMP/true"
+
+for state in fresh bloated; do
+    for backend in fork spawn zygote; do
+        : > "$TMP/cmds"
+        [ $state = bloated ] && cat "$TMP/bloat" >> "$TMP/cmds"
+        echo "launcher $backend" >> "$TMP/cmds"
+        cat "$TMP/true" >> "$TMP/cmds"
+        echo "stats /bin/true" >> "$TMP/cmds"
+
+        "$MYSHELL" < "$TMP/cmds" | awk -v b="$backend" -v s="$state" -v n="$COUNT" '
+            $1 == "/bin/true" { printf "%-7s %-6s %d spawns, mean %s, p50 %s, p99 %s\n", s, b, n, $3, $4, $5 }'
+    done
+done
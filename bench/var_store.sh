@@ -0,0 +1,30 @@
+#!/bin/sh
+# Variable store benchmark: sets COUNT distinct variables, then reads each
+# one back with `echo $name`, and reports sets/second and gets/second.
+#
+#   sh bench/var_store.sh [COUNT]
+
+COUNT=${1:-100000}
+. "$(dirname "$0")/common.sh"
+
+awk -v n="$COUNT" 'BEGIN { for (i = 0; i < n; i++) printf "var%d=value%d\n", i, i }' > "$TMP/set"
+cp "$TMP/set" "$TMP/setget"
+awk -v n="$COUNT" 'BEGIN { for (i = 0; i < n; i++) printf "echo $var%d\n", (i * 7919) % n }' >> "$TMP/setget"
+
+run() {
+    start=$(date +%s%N)
+    "$MYSHELL" < "$1" > /dev/null
+    end=$(date +%s%N)
+    echo $((end - start))
+}
+
+set_ns=$(run "$TMP/set")
+all_ns=$(run "$TMP/setget")
+
+awk -v n="$COUNT" -v s="$set_ns" -v a="$all_ns" 'BEGIN {
+    g = a - s
+    if (g <= 0) g = 1
+    printf "variables: %d\n", n
+    printf "sets/sec: %.0f\n", n / (s / 1e9)
+    printf "gets/sec: %.0f\n", n / (g / 1e9)
+}'
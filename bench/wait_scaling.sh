@@ -0,0 +1,27 @@
+#!/bin/sh
+# wait -n with many jobs outstanding: starts IDLE long-running background
+# jobs (default 5000), then times 200 rounds of `/bin/true &` + `wait -n`.
+# The wait itself does not depend on IDLE; the run with 10 idle jobs is
+# the baseline. With spawn, each child still starts with a copy of the
+# shell's IDLE pidfds and closes them on exec, inside the time waited for;
+# zygote children start from the fork server's small descriptor table.
+#
+#   sh bench/wait_scaling.sh [IDLE]
+
+IDLE=${1:-5000}
+. "$(dirname "$0")/common.sh"
+
+for launcher in spawn zygote; do
+for idle in 10 "$IDLE"; do
+    {
+        for i in $(seq "$idle"); do echo "sleep 600 &"; done
+        echo "stats -r"
+        for i in $(seq 200); do printf '/bin/true &\nwait -n\n'; done
+        echo "stats wait"
+        for i in $(seq "$idle"); do echo "kill %$i"; done
+    } > "$TMP/script"
+    MYSHELL_LAUNCHER=$launcher "$MYSHELL" "$TMP/script" 2> /dev/null |
+        awk -v n="$idle" -v l="$launcher" '$1 == "wait" {
+            printf "%-6s %5d idle jobs: wait -n mean %s p50 %s p99 %s\n", l, n, $3, $4, $5 }'
+done
+done
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <ctype.h>
 #include <string.h>
 #include <stdio.h>
@@ -8,457 +9,5686 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <errno.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <termios.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #define MAX_LEN 512
-#define MAXARGS 10
-#define ARGLEN 30
 #define PROMPT "MUSAshell:- "
-#define HISTORY_SIZE 10
-#define MAX_JOBS 10
-#define MAX_VARIABLES 20
+#define HISTORY_SIZE 1000        // default when $HISTSIZE is not set
+#define MAX_HISTORY_SIZE (1 << 24)
+#define HISTORY_FILE ".myshell_history"
+#define TRIGRAM_BUCKETS 65536
+#define HISTORY_SHORT_SCAN 4096  // entries a query under three bytes looks through
+#define HISTORY_INDEX_SLICE 4096 // entries indexed per step while the prompt is idle
+#define SUGGEST_CANDIDATES 64    // matches weighed when picking a suggestion
+#define KEY_LEFT 1000           // read_key() codes for escape sequences
+#define KEY_RIGHT 1001
+#define KEY_UP 1002
+#define KEY_DOWN 1003
+#define KEY_HOME 1004
+#define KEY_END 1005
+#define KEY_DELETE 1006
+#define CMD_EMPTY 0     // blank line or comment
+#define CMD_ASSIGN 1    // name=value
+#define CMD_REPEAT 2    // !n / !-k
+#define CMD_PIPELINE 3  // one or more stages joined by |
+#define CMD_INVALID 4
+#define TOK_WORD 0      // lex_line() span kinds
+#define TOK_PIPE 1      // |
+#define TOK_IN 2        // <
+#define TOK_OUT 3       // >
+#define TOK_AMP 4       // &
+#define TOK_SEMI 5      // ;
+#define LEX_SCALAR 0    // lex_scan() implementations
+#define LEX_SSE2 1
+#define LEX_AVX2 2
+#define JOB_RUNNING 0
+#define JOB_DONE 1
+#define JOB_STOPPED 2   // a foreground job stopped by Ctrl-Z
+#define READ_CHUNK 65536
+#define WRITE_BUFFER 65536
+#define CAPTURE_HEADER 4096      // memfd offset where captured $(...) output starts
+#define JOBLOG_SIZE (1 << 20)    // default ring per captured background job
+#define JOBLOG_READS 16          // reads per wakeup, so a chatty job cannot starve the prompt
+#define GLOB_DIRBUF (256 * 1024) // getdents64 batch: a few thousand entries per call
+#define GLOB_THREADS 16          // most threads walking one ** pattern
+#define COMPLETE_DIRS 63         // PATH directories watched for completion
+#define COMPLETE_BUILTIN 63      // trie bit marking a builtin
+#define COMPLETE_LIST 200        // most candidates listed under the prompt
+#define DIR_CACHE 16             // directory listings kept for filename completion
+#define TRACE_RING 16384         // events buffered per thread; more are dropped
+#define TRACE_DETAIL 48
+#define TRACE_FLUSH_MS 50
+#define HIST_SUB_BITS 4          // 16 linear steps per power of two, ~6% error
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+#define ARENA_CHUNK 65536
+#define LAUNCH_FORK 0
+#define LAUNCH_SPAWN 1
+#define LAUNCH_ZYGOTE 2
+#define ZYGOTE_FD 3              // the zygote's end of the socket
+#define ZYGOTE_MSG (128 * 1024)  // largest request: path, redirections, argv, environ
+#define BUILTIN_PARENT 1   // changes shell state, so never runs in a child
+#define BUILTIN_PIPE 2     // may run as a pipeline stage
+#define BUILTIN_SLOTS 128
+#define IOPRIO_WHO_PROCESS 1     // ioprio_set(2); glibc has no wrapper or header
+#define IOPRIO_CLASS_SHIFT 13
 
-int execute(char* arglist[], int background);
-char** tokenize(char* cmdline);
+// Block-buffered line reader: input is pulled in large chunks with read(2)
+// and lines are handed back as NUL-terminated views into the chunk buffer
+typedef struct {
+    int fd;
+    char* buf;
+    size_t cap;
+    size_t start;   // first byte not yet returned as a line
+    size_t end;     // one past the last byte read so far
+    int eof;
+} LineReader;
+
+// Buffered writer for everything the shell itself prints on stdout. Builtins
+// write here, so a run of them costs one write(2) per buffer, not per line.
+typedef struct {
+    int fd;
+    size_t len;
+    struct ArenaChunk** capture;  // set while a $(builtin) collects the output
+    char buf[WRITE_BUFFER];
+} Writer;
+
+// Bump-pointer arena for per-command scratch memory. Chunks are kept across
+// resets so a steady stream of commands makes no heap calls at all.
+typedef struct ArenaChunk {
+    struct ArenaChunk* next;
+    size_t size;
+    size_t used;
+    int mapped;         // a $(...) capture mapped from a memfd
+    char data[];
+} ArenaChunk;
+
+typedef struct {
+    ArenaChunk* head;
+    ArenaChunk* cur;
+    ArenaChunk* large;  // oversized one-off allocations, freed on reset
+} Arena;
+
+// Everything needed to start one command
+typedef struct {
+    char** argv;
+    char* infile;       // from `<`, NULL if none
+    char* outfile;      // from `>`, NULL if none
+    int in_fd;          // pipe end to use as stdin, -1 if none
+    int out_fd;         // pipe end to use as stdout, -1 if none
+    int err_fd;         // pipe end to use as stderr, -1 if none
+    pid_t pgid;         // process group to join, 0 to lead a new one
+    int foreground;     // hand the terminal to the process group
+    char* path;         // resolved executable, filled in by launch_process()
+    int stage;          // position in its pipeline, for tracing
+} Launch;
+
+// One running child of the parallel builtin
+typedef struct {
+    pid_t pid;          // 0 when the slot is free
+    size_t item;
+} ParallelSlot;
+
+// Fixed part of a launch request sent to the zygote. It is followed by
+// NUL-separated path, infile, outfile (empty if none), argc argv words and
+// envc environment strings. stdin, stdout, stderr and the working directory
+// travel alongside as SCM_RIGHTS descriptors.
+typedef struct {
+    int pgid;
+    int terminal;   // give the terminal to the new process group
+    int argc;
+    int envc;
+} ZygoteRequest;
+
+// Position in an arena, for releasing everything allocated after it
+typedef struct {
+    ArenaChunk* cur;
+    size_t used;
+    ArenaChunk* large;
+} ArenaMark;
+
+// One stage of a pipeline: its words and the files from `<` / `>`
+typedef struct {
+    char** argv;
+    char* infile;
+    char* outfile;
+} Stage;
+
+// One token of a command line: where it is in the line and what it is.
+// A word keeps its quotes and escapes; expansion removes them.
+typedef struct {
+    unsigned offset;
+    unsigned length;
+    int kind;           // TOK_*
+} Span;
+
+// A parsed line. Parsing happens once; running it never re-tokenizes, so a
+// script that is sourced or looped over keeps reusing the same Commands.
+// The words point into the line they were parsed from.
+typedef struct Command {
+    int kind;
+    char* text;         // the line as written
+    char* name;         // CMD_ASSIGN
+    char* value;
+    Stage* stages;      // CMD_PIPELINE
+    int nstages;
+    int background;
+    int timed;          // prefixed with the `time` keyword
+    struct Command* next;  // the command after a `;` or `&`, NULL at the end
+} Command;
+
+// A whole script parsed into Commands, all owned by its arena
+typedef struct Script {
+    Arena arena;
+    Command* commands;
+    int count;
+    dev_t dev;          // source cache key
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+    struct Script* next;
+} Script;
+
+// Registration entry for a builtin command. help is generated from the table.
+typedef struct {
+    const char* name;
+    int (*fn)(char** arglist);  // returns the command's exit status
+    int flags;
+    const char* usage;
+    const char* help;
+} Builtin;
+
+// One resolved external command in the PATH cache
+typedef struct {
+    char* name;
+    char* path;
+    unsigned long hits;
+} PathEntry;
+
+// One finished span for the trace file
+typedef struct {
+    const char* name;   // static string: read, parse, lex, ...
+    unsigned long long start;
+    unsigned long long dur;
+    int pid;            // child the span is about, 0 for the shell itself
+    int stage;          // pipeline stage, -1 if none
+    char detail[TRACE_DETAIL];
+} TraceEvent;
+
+// Per-thread single-producer ring: the owning thread advances head, the
+// flusher thread advances tail, and neither ever waits for the other
+typedef struct TraceRing {
+    _Atomic unsigned long head;
+    _Atomic unsigned long tail;
+    unsigned long dropped;
+    int tid;
+    struct TraceRing* next;
+    TraceEvent events[TRACE_RING];
+} TraceRing;
+
+// Latency histogram for one command name, in nanoseconds. Buckets are
+// log-linear like HdrHistogram: exact below 16, then 16 per power of two.
+typedef struct {
+    char* name;
+    unsigned long hash;
+    unsigned long count;
+    unsigned long long max;
+    unsigned long long total;
+    unsigned long long* buckets;
+} CmdStats;
+
+// Command numbers whose text contains a given trigram (or one hashing to the
+// same bucket), oldest first. Each is stored as its distance from the one
+// before, seven bits a byte with the high bit set on all but the last byte,
+// so the list can also be walked back from its newest number.
+typedef struct {
+    unsigned char* bytes;
+    unsigned int len;
+    unsigned int cap;
+    unsigned int n;     // numbers in the list
+    unsigned int last;  // the newest of them, 0 when empty
+} Posting;
+
+// How often a command has been entered, keyed by its hash
+typedef struct {
+    unsigned long hash;
+    unsigned long count;
+} HistoryFreq;
+
+// Line being edited at the interactive prompt
+typedef struct {
+    char* buf;
+    size_t len;
+    size_t pos;
+    size_t cap;
+} EditLine;
+
+// Prefix trie of the executables on $PATH and the builtins. Nodes sit in
+// one array and link by index; children are sorted, so a walk lists names
+// in order.
+typedef struct {
+    unsigned child;     // first child, 0 if none
+    unsigned sibling;   // next child of the same parent
+    unsigned live;      // names at or below this node
+    unsigned char c;
+    unsigned long long dirs;  // bit i: PATH directory i has it; COMPLETE_BUILTIN
+} TrieNode;
+
+// A directory listing for filename completion, used while the directory's
+// mtime is unchanged. Each name is preceded by 'd' (directory) or 'f'.
+typedef struct {
+    char* path;
+    struct timespec mtime;
+    struct ArenaChunk* names;
+} DirListing;
+
+// Candidates for one completion, allocated in cmd_arena. Each ends with
+// what Tab would put after it: a space, or '/' for a directory.
+typedef struct {
+    char** items;
+    size_t count;
+    size_t cap;
+} Completions;
+
+// Where a job runs: CPU set, scheduling policy and nice value, I/O class.
+// Anything not set is left as the process inherited it.
+typedef struct {
+    int has_cpus;
+    cpu_set_t cpus;
+    int policy;         // SCHED_*, -1 if unset
+    int priority;       // for SCHED_FIFO / SCHED_RR
+    int has_nice;
+    int nice;
+    int ioclass;        // 1 realtime, 2 best-effort, 3 idle; 0 if unset
+    int iolevel;
+} Placement;
+
+// sched_setattr(2)'s argument, which older C libraries do not declare
+typedef struct {
+    uint32_t size;
+    uint32_t sched_policy;
+    uint64_t sched_flags;
+    int32_t sched_nice;
+    uint32_t sched_priority;
+    uint64_t sched_runtime;
+    uint64_t sched_deadline;
+    uint64_t sched_period;
+} SchedAttr;
+
+struct Job;
+
+// One process of a background job
+typedef struct {
+    pid_t pid;
+    int pidfd;          // registered in job_epfd; -1 if pidfd_open failed
+    int status;
+    int done;
+    struct Job* job;
+} JobProc;
+
+// Structure to keep track of background jobs
+typedef struct Job {
+    int id;             // the n in %n
+    pid_t pgid;
+    JobProc* procs;
+    int nprocs;
+    int alive;          // processes not yet reaped
+    int state;
+    int status;         // exit status once state is JOB_DONE
+    char* command;
+    Placement place;    // what `run` asked for, at start or since
+} Job;
+
+// Captured stdout/stderr of a background job (set -o joblog). The newest
+// cap bytes stay in memory; older ones move to an unlinked temp file. A log
+// outlives its job, until the job number is reused or it is discarded.
+typedef struct {
+    char* command;
+    int fd;             // read end of the job's output pipe, -1 once every writer is gone
+    char* ring;
+    size_t cap;
+    size_t total;       // bytes read so far; the ring holds the last min(total, cap)
+    size_t spilled;     // bytes [0, spilled) belong to the spill file
+    size_t lost;        // of those, how many could not be written to it
+    int spill_fd;       // -1 until the ring first wraps
+} JobLog;
+
+// Length-prefixed variable value; cap is the room in data, excluding the NUL
+typedef struct {
+    size_t len;
+    size_t cap;
+    char data[];
+} VarValue;
+
+// Structure to store user-defined variables. Entries are only ever appended,
+// so their order is insertion order; the hash table holds indexes into them.
+// The environment is imported into the same table at startup.
+typedef struct {
+    char* name;          // allocated once, when the variable is first set
+    unsigned long hash;
+    VarValue* value;     // NULL once unset; the entry stays for reuse
+    int exported;        // passed to commands in env_vec
+} Variable;
+
+// A directory still to be read for a glob, and the pattern component its
+// entries are matched against
+typedef struct {
+    char* dir;  // "" for the working directory
+    int comp;
+} GlobTask;
+
+// One glob thread's deque: the owner pushes and pops at the tail, idle
+// threads steal from the head. Its matches collect in a private buffer.
+typedef struct {
+    pthread_mutex_t lock;
+    GlobTask* tasks;
+    size_t head, tail, cap;
+    struct Glob* glob;
+    int id;
+    char* dirbuf;
+    ArenaChunk* found;  // NUL-terminated paths, back to back
+    size_t nfound;
+} GlobWorker;
+
+typedef struct Glob {
+    char** comps;       // the pattern split on '/'
+    char** literal;     // per component: unescaped if it has no magic, else NULL
+    int ncomps;
+    int dir_only;       // the pattern ended in '/'
+    GlobWorker* workers;
+    int nworkers;
+    atomic_long pending;  // tasks queued or running
+} Glob;
+
+int execute(Stage* stage, int background, const char* text, const Placement* where);
+Span* lex_line(Arena* a, const char* line, size_t len, size_t* count);
+const char* lex_scan(const char* p, const char* end);
 char* read_cmd(char*, FILE*);
-int handle_redirection(char** arglist);
-int handle_pipe(char* cmdline);
-void handle_sigchld(int sig);
-void trim_whitespace(char* str);
+void reader_init(LineReader* r, int fd);
+void out_write(const char* data, size_t len);
+void out_printf(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+void out_flush();
+char* reader_next_line(LineReader* r, size_t* lenp);
+void* arena_alloc(Arena* a, size_t n);
+char* arena_strndup(Arena* a, const char* s, size_t n);
+char* arena_strdup(Arena* a, const char* s);
+void arena_reset(Arena* a);
+ArenaMark arena_mark(Arena* a);
+void arena_release(Arena* a, ArenaMark m);
+void chunk_free(ArenaChunk* c);
+ArenaChunk* chunk_new(size_t size);
+void capture_append(ArenaChunk** chunk, const char* data, size_t n);
+void parse_command(Arena* a, char* line, Command* cmd);
+Script* parse_script(char* text, size_t len);
+Script* load_script(const char* path);
+int run_command(Command* cmd);
+int run_timed(Command* cmd);
+int dispatch_command(Command* cmd);
+void add_child_usage(const struct rusage* ru);
+unsigned long long now_ns();
+void stats_record(const char* name, unsigned long long ns);
+unsigned long long trace_begin();
+void trace_span(const char* name, const char* detail, unsigned long long start, int pid, int stage);
+int trace_start(const char* path);
+void trace_stop();
+char* expand_word(const char* word);
+char* expand_pattern(const char* word);
+char* glob_unescape(char* word);
+const char* skip_substitution(const char* p);
+char* capture_command(const char* text, size_t textlen, size_t* lenp);
+char** expand_argv(char** argv);
+int glob_magic(const char* word);
+int glob_match(const char* pat, const char* name);
+char** glob_expand(const char* pattern, size_t* count);
+int glob_is_dir(int dirfd, struct dirent64* e, int follow);
+int redirect_begin(const char* infile, const char* outfile, int saved[2]);
+void redirect_end(int saved[2]);
+int run_script(Script* script);
+pid_t launch_process(Launch* l);
+pid_t launch_fork(Launch* l);
+void close_cloexec_fds();
+pid_t launch_spawn(Launch* l);
+pid_t launch_zygote(Launch* l);
+int zygote_start();
+int zygote_main(int sock);
+int is_builtin(const char* name);
+unsigned long hash_string(const char* s);
+char* lookup_command(const char* name);
+void path_cache_forget(const char* name);
+void path_cache_clear();
+void path_cache_list();
+int handle_pipe(Stage* stages, int n, int background, const char* text, const Placement* where);
+int placement_parse(char** argv, Placement* p, int quiet);
+int placement_apply(pid_t pid, const Placement* p);
+void placement_format(const Placement* p, char* buf, size_t size);
+int run_targets_job(char** argv);
+int pipeline_status(int* statuses, int n);
+char* trim_whitespace(char* str);
 void add_to_history(char* command);
+void history_init(const char* size);
+void history_resize(unsigned long size);
+void history_load();
+char* history_entry(unsigned long n);
+int history_is_mapped(const char* entry);
+void history_index_build();
+int history_index_step(unsigned long limit);
+void history_index_add(unsigned long n, const char* entry);
+unsigned long history_search(const char* query, unsigned long before);
+char* history_suggest(const char* prefix);
+unsigned long history_frequency(const char* entry);
+char* edit_line(const char* prompt);
+void edit_complete();
+void exec_trie_sync();
+void complete_word(const char* word, int command, Completions* out);
 int execute_builtin(char** arglist);
-void list_jobs();
-void remove_job(pid_t pid);
-void add_job(pid_t pid, char* command);
-int handle_variable(char* cmdline);
+const Builtin* find_builtin(const char* name);
+extern const Builtin builtins[];
+void list_jobs(int verbose);
+void remove_job(Job* job);
+Job* add_job(pid_t pgid, pid_t* pids, int n, const char* command);
+void job_stopped(pid_t pgid, pid_t* pids, int n, const char* command, int status);
+Job* find_job(const char* spec);
+JobProc* find_job_proc(pid_t pid);
+void job_proc_exited(JobProc* proc, int status);
+void jobs_init();
+void jobs_poll(int timeout);
+void jobs_notify();
+JobLog* joblog_new(const char* command, int* write_fd);
+void joblog_attach(JobLog* log, int id);
+void joblog_drain(JobLog* log, int reads);
+void joblogs_poll();
+void joblog_free(JobLog* log);
+void wait_for_input(int fd);
+void set_positional(int argc, char** argv);
 char* get_variable_value(const char* name);
 void set_variable(const char* name, const char* value);
+Variable* variable_entry(const char* name, unsigned long h);
+void env_import();
+char** env_build();
 void list_user_variables();
+Variable* find_variable(const char* name, unsigned long h);
+int is_assignment(const char* cmdline);
+
+
+// Global variables for command history, jobs, and user-defined variables
+// History is a power-of-two ring: command number n (counting from 1) lives in
+// history[(n - 1) & history_mask] for as long as it is among the newest
+// history_mask + 1 commands.
+char** history = NULL;
+unsigned long history_mask = 0;
+unsigned long history_count = 0;
+char* history_path = NULL;  // NULL when history is not persisted
+int history_fd = -1;        // append-only handle, opened on first use
+int history_loaded = 0;     // the file has been mapped into the ring
+int history_write_failed = 0;
+char* history_map = NULL;   // private mapping the loaded entries point into
+size_t history_map_len = 0;
+Posting* trigram_index = NULL;  // built a slice at a time while the prompt waits
+unsigned long history_indexed = 0;  // newest command number in trigram_index
+HistoryFreq* history_freq = NULL;
+size_t history_freq_cap = 0;
+size_t history_freq_count = 0;
+EditLine edit;
+TrieNode* exec_trie = NULL;  // node 0 is the root
+unsigned exec_trie_len = 0;
+unsigned exec_trie_cap = 0;
+char* exec_trie_path = NULL;  // the $PATH it was built from, NULL until first Tab
+char* exec_dirs[COMPLETE_DIRS];
+int exec_watches[COMPLETE_DIRS];
+int exec_ndirs = 0;
+int exec_inotify = -1;
+DirListing dir_cache[DIR_CACHE];
+int dir_cache_next = 0;
+Job** jobs = NULL;          // indexed by job id - 1, NULL for unused ids
+int job_slots = 0;
+int job_max = 0;            // highest job id in use
+int job_count = 0;
+JobProc** job_pids = NULL;  // open-addressing map from pid to its JobProc
+size_t job_pids_cap = 0;
+size_t job_pids_count = 0;  // background processes not yet reaped, all in job_pids
+int job_epfd = -1;          // one pidfd per background process
+int jobs_without_pidfd = 0; // processes that must be reaped by waitpid(-1)
+pid_t last_background = 0;  // $!: the last process started with &
+int job_timer_fired = 0;    // wait -t's timerfd, in job_epfd with a NULL ptr, expired
+JobLog** job_logs = NULL;   // indexed by job id - 1, like jobs
+int job_log_slots = 0;
+int joblog_epfd = -1;       // read ends of the log pipes; itself in job_epfd
+int joblogs_open = 0;       // log pipes not yet at EOF
+int joblog_on = 0;          // set -o joblog
+size_t joblog_size = JOBLOG_SIZE;
+Job** finished = NULL;      // jobs to report as Done at the next prompt
+int finished_count = 0;
+int finished_cap = 0;
+Variable* variables = NULL;
+size_t variable_count = 0;
+size_t variable_cap = 0;
+size_t* var_slots = NULL;   // open-addressing table of index + 1, 0 = empty
+size_t var_slots_cap = 0;
+char** env_vec = NULL;      // envp for every exec, rebuilt only when env_dirty
+size_t env_vec_cap = 0;
+char* env_block = NULL;     // the NAME=value strings env_vec points into
+size_t env_block_cap = 0;
+int env_dirty = 1;          // an exported variable changed since the last build
+LineReader stdin_reader;
+Writer out = { STDOUT_FILENO, 0, NULL, "" };
+int stdin_redirected = 0;  // a builtin's `<` is in place on fd 0
+Arena cmd_arena;  // owns everything built for the command being run
+int last_status = 0;
+int interactive = 0;  // stdin is a terminal we hand to foreground pipelines
+Script* source_cache = NULL;
+struct rusage child_usage;  // foreground children reaped since it was cleared
+int trace_on = 0;           // spans are being recorded
+pid_t trace_pid = 0;        // the shell that owns the trace file and flusher
+char* trace_path = NULL;
+int trace_fd = -1;
+char trace_buf[WRITE_BUFFER]; // only touched by the flusher (or by trace_stop after it)
+size_t trace_len = 0;
+int trace_events = 0;       // events written so far
+unsigned long long trace_epoch = 0;
+pthread_t trace_thread;
+atomic_int trace_stopping;
+_Atomic(TraceRing*) trace_rings = NULL;
+__thread TraceRing* trace_ring = NULL;
+CmdStats* cmd_stats = NULL;  // open addressing on the command name
+size_t cmd_stats_cap = 0;
+size_t cmd_stats_count = 0;
+int lex_isa = -1;           // LEX_*, picked on first use
+int glob_off = 0;           // set -o noglob
+int glob_sort = 1;          // set +o globsort keeps matches in directory order
+int launcher = LAUNCH_SPAWN;
+int zygote_fd = -1;         // socket to the fork server, -1 until started
+pid_t zygote_pid = 0;
+extern char** environ;
+
+// Hashed PATH lookups (open addressing, power-of-two capacity)
+PathEntry* path_cache = NULL;
+size_t path_cache_cap = 0;
+size_t path_cache_count = 0;
+char* path_cache_key = NULL;  // value of $PATH the entries were resolved against
+unsigned long path_hits = 0;
+unsigned long path_misses = 0;
+
+int main(int argc, char** argv) {
+    // The fork server is this binary re-executed, so it starts from a
+    // fresh image and never grows
+    if (argc == 2 && strcmp(argv[1], "--zygote") == 0) return zygote_main(ZYGOTE_FD);
+
+    // Initialize history; the history file is only read on first use or
+    // while an interactive prompt waits for a key
+    history_init(getenv("HISTSIZE"));
+    env_import();
+
+    jobs_init();
+    atexit(out_flush);
+    char* trace = getenv("MYSHELL_TRACE");
+    if (trace != NULL && trace[0] != '\0') trace_start(trace);
+    atexit(trace_stop);
+    char* backend = getenv("MYSHELL_LAUNCHER");
+    if (backend != NULL && strcmp(backend, "fork") == 0) launcher = LAUNCH_FORK;
+    if (backend != NULL && strcmp(backend, "zygote") == 0 && zygote_start() == 0)
+        launcher = LAUNCH_ZYGOTE;
+
+    // myshell -c 'commands' [name args...]: parse the string once and run it
+    if (argc == 2 && strcmp(argv[1], "-c") == 0) {
+        fprintf(stderr, "myshell: -c: option requires an argument\n");
+        return 2;
+    }
+    if (argc > 2 && strcmp(argv[1], "-c") == 0) {
+        set_positional(argc - 3, argv + 3);
+        run_script(parse_script(argv[2], strlen(argv[2])));
+        jobs_poll(0);
+        return last_status;
+    }
+    // myshell script.sh [args...]
+    if (argc > 1) {
+        set_positional(argc - 1, argv + 1);
+        Script* script = load_script(argv[1]);
+        if (script == NULL) {
+            fprintf(stderr, "myshell: %s: %s\n", argv[1], strerror(errno));
+            return 127;
+        }
+        run_script(script);
+        jobs_poll(0);
+        return last_status;
+    }
+
+    interactive = isatty(STDIN_FILENO);
+    // Needed to take the terminal back from a foreground process group
+    if (interactive) signal(SIGTTOU, SIG_IGN);
+    reader_init(&stdin_reader, fileno(stdin));
+
+    char *cmdline;
+    char* prompt = interactive ? PROMPT : "";
+    for (;;) {
+        jobs_poll(0);
+        jobs_notify();
+        if ((cmdline = read_cmd(prompt, stdin)) == NULL) break;
+        arena_reset(&cmd_arena);
+        cmdline = trim_whitespace(cmdline);
+
+        // Only what is typed at the prompt is history; lines from a pipe or
+        // a script are not, and a `!number` repeat is not itself recorded
+        if (interactive && cmdline[0] != '!') add_to_history(cmdline);
+        // The words point into the parsed line, so it is copied out of the
+        // reader's buffer, which `read` may refill while they are in use
+        Command cmd;
+        parse_command(&cmd_arena, arena_strdup(&cmd_arena, cmdline), &cmd);
+        run_command(&cmd);
+    }
+    if (interactive) out_printf("\n");
+    return 0;
+}
+
+// Set $0, $1... and $# for a script or -c string
+void set_positional(int argc, char** argv) {
+    char name[16];
+    for (int i = 0; i < argc; i++) {
+        snprintf(name, sizeof(name), "%d", i);
+        set_variable(name, argv[i]);
+    }
+    snprintf(name, sizeof(name), "%d", argc > 0 ? argc - 1 : 0);
+    set_variable("#", name);
+}
+
+// Build one command of a list from its spans. Words are cut out of the line
+// in place: the spans are all known by now, so the byte after each word can
+// become its NUL even where it was the `|` or `>` that ended it.
+void parse_simple(Arena* a, char* line, Span* spans, size_t n, int background, Command* cmd) {
+    memset(cmd, 0, sizeof(Command));
+    size_t end = n > 0 ? spans[n - 1].offset + spans[n - 1].length : 0;
+    if (background) end = spans[n].offset + 1;
+    cmd->text = n > 0 ? arena_strndup(a, line + spans[0].offset, end - spans[0].offset)
+                      : arena_strdup(a, "&");
+    cmd->background = background;
+    if (n > 0 && spans[0].kind == TOK_WORD && spans[0].length == 4 &&
+        memcmp(line + spans[0].offset, "time", 4) == 0) {
+        cmd->timed = 1;
+        spans++;
+        n--;
+    }
+    if (n == 0) {
+        cmd->kind = background ? CMD_INVALID : CMD_EMPTY;
+        return;
+    }
+
+    // name=value takes the rest of the command as written
+    char* first = line + spans[0].offset;
+    if (spans[0].kind == TOK_WORD && is_assignment(first)) {
+        char* equal_sign = strchr(first, '=');
+        size_t vend = spans[n - 1].offset + spans[n - 1].length;
+        cmd->kind = CMD_ASSIGN;
+        cmd->name = arena_strndup(a, first, equal_sign - first);
+        cmd->value = trim_whitespace(arena_strndup(a, equal_sign + 1, line + vend - equal_sign - 1));
+        return;
+    }
+
+    int nstages = 1;
+    for (size_t i = 0; i < n; i++) nstages += spans[i].kind == TOK_PIPE;
+    cmd->kind = CMD_PIPELINE;
+    cmd->stages = arena_alloc(a, sizeof(Stage) * nstages);
+    cmd->nstages = nstages;
+    size_t i = 0;
+    for (int s = 0; s < nstages; s++, i++) {
+        Stage* st = &cmd->stages[s];
+        int argc = 0;
+        size_t j = i;
+        for (; j < n && spans[j].kind != TOK_PIPE; j++) {
+            if (spans[j].kind == TOK_WORD) argc++;
+        }
+        st->argv = arena_alloc(a, sizeof(char*) * (argc + 1));
+        st->infile = NULL;
+        st->outfile = NULL;
+        argc = 0;
+        for (; i < j; i++) {
+            char* word = line + spans[i].offset;
+            if (spans[i].kind == TOK_WORD) {
+                st->argv[argc++] = word;
+            } else if ((spans[i].kind == TOK_IN || spans[i].kind == TOK_OUT) && i + 1 < j &&
+                       spans[i + 1].kind == TOK_WORD) {
+                // `< file` and `> file`, on whichever stage they are written
+                word = line + spans[++i].offset;
+                if (spans[i - 1].kind == TOK_IN) st->infile = word;
+                else st->outfile = word;
+            } else {
+                cmd->kind = CMD_INVALID;
+            }
+        }
+        st->argv[argc] = NULL;
+        if (argc == 0) cmd->kind = CMD_INVALID;
+    }
+    for (size_t k = 0; k < n; k++) {
+        if (spans[k].kind == TOK_WORD) line[spans[k].offset + spans[k].length] = '\0';
+    }
+}
+
+// Parse one line into cmd, allocating from a. The line is modified and the
+// words point into it, so it must live as long as cmd. Commands separated
+// by `;` or `&` are chained through cmd->next.
+void parse_line(Arena* a, char* line, Command* cmd) {
+    memset(cmd, 0, sizeof(Command));
+    line = trim_whitespace(line);
+    if (line[0] == '\0' || line[0] == '#') {
+        cmd->text = line;
+        cmd->kind = CMD_EMPTY;
+        return;
+    }
+    if (line[0] == '!') {
+        cmd->text = arena_strdup(a, line);
+        cmd->kind = CMD_REPEAT;
+        return;
+    }
+
+    size_t count;
+    Span* spans = lex_line(a, line, strlen(line), &count);
+    Command* c = NULL;
+    size_t from = 0;
+    for (size_t i = 0; i <= count; i++) {
+        if (i < count && spans[i].kind != TOK_SEMI && spans[i].kind != TOK_AMP) continue;
+        int background = i < count && spans[i].kind == TOK_AMP;
+        // Empty commands between separators are skipped, except a lone `&`
+        if (i > from || background) {
+            if (c == NULL) {
+                c = cmd;
+            } else {
+                c->next = arena_alloc(a, sizeof(Command));
+                c = c->next;
+            }
+            parse_simple(a, line, spans + from, i - from, background, c);
+        }
+        from = i + 1;
+    }
+    if (c == NULL) {
+        cmd->text = line;
+        cmd->kind = CMD_EMPTY;
+    }
+}
+
+void parse_command(Arena* a, char* line, Command* cmd) {
+    unsigned long long start = trace_begin();
+    parse_line(a, line, cmd);
+    trace_span("parse", cmd->text, start, 0, -1);
+}
+
+// Parse a whole script into its own arena
+Script* parse_script(char* text, size_t len) {
+    Script* script = calloc(1, sizeof(Script));
+    char* copy = arena_strndup(&script->arena, text, len);
+    int lines = 1;
+    for (char* p = copy; (p = memchr(p, '\n', copy + len - p)) != NULL; p++) lines++;
+
+    script->commands = arena_alloc(&script->arena, sizeof(Command) * lines);
+    char* line = copy;
+    while (line != NULL) {
+        char* nl = strchr(line, '\n');
+        if (nl != NULL) *nl = '\0';
+        Command* cmd = &script->commands[script->count];
+        parse_command(&script->arena, line, cmd);
+        if (cmd->kind != CMD_EMPTY) script->count++;
+        line = nl != NULL ? nl + 1 : NULL;
+    }
+    return script;
+}
+
+// Parse a script file, reusing the cached parse if the file is unchanged
+// (same device, inode, mtime and size). Returns NULL with errno set.
+Script* load_script(const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+
+    Script** link = &source_cache;
+    for (Script* s = source_cache; s != NULL; link = &s->next, s = s->next) {
+        if (s->dev != st.st_dev || s->ino != st.st_ino) continue;
+        if (s->mtime.tv_sec == st.st_mtim.tv_sec && s->mtime.tv_nsec == st.st_mtim.tv_nsec &&
+            s->size == st.st_size) {
+            close(fd);
+            return s;
+        }
+        // Stale: drop it and parse again
+        *link = s->next;
+        arena_reset(&s->arena);
+        for (ArenaChunk* c = s->arena.head; c != NULL;) {
+            ArenaChunk* next = c->next;
+            free(c);
+            c = next;
+        }
+        free(s);
+        break;
+    }
+
+    char* text = malloc(st.st_size + 1);
+    size_t got = 0;
+    while (got < (size_t)st.st_size) {
+        ssize_t n = read(fd, text + got, st.st_size - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        got += n;
+    }
+    close(fd);
+
+    Script* script = parse_script(text, got);
+    free(text);
+    script->dev = st.st_dev;
+    script->ino = st.st_ino;
+    script->mtime = st.st_mtim;
+    script->size = st.st_size;
+    script->next = source_cache;
+    source_cache = script;
+    return script;
+}
+
+// Run every command of a script. Scratch memory used by each command is
+// released afterwards, so long scripts run in constant memory.
+int run_script(Script* script) {
+    for (int i = 0; i < script->count; i++) {
+        ArenaMark mark = arena_mark(&cmd_arena);
+        run_command(&script->commands[i]);
+        arena_release(&cmd_arena, mark);
+    }
+    return last_status;
+}
+
+double timeval_seconds(struct timeval tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Run a parsed line: each command of its `;` / `&` list in turn
+int run_command(Command* cmd) {
+    for (; cmd != NULL; cmd = cmd->next) run_timed(cmd);
+    return last_status;
+}
+
+// Run one parsed command. With the `time` keyword, report its wall time and
+// the user/sys time and peak RSS of the children it waited for (or of the
+// shell itself for builtins).
+int run_timed(Command* cmd) {
+    if (!cmd->timed) return dispatch_command(cmd);
+    struct rusage self_before, self_after;
+    memset(&child_usage, 0, sizeof(child_usage));
+    getrusage(RUSAGE_SELF, &self_before);
+    unsigned long long start = now_ns();
+    dispatch_command(cmd);
+    double real = (now_ns() - start) / 1e9;
+    getrusage(RUSAGE_SELF, &self_after);
+
+    double user = timeval_seconds(child_usage.ru_utime) + timeval_seconds(self_after.ru_utime) -
+                  timeval_seconds(self_before.ru_utime);
+    double sys = timeval_seconds(child_usage.ru_stime) + timeval_seconds(self_after.ru_stime) -
+                 timeval_seconds(self_before.ru_stime);
+    long maxrss = child_usage.ru_maxrss > 0 ? child_usage.ru_maxrss : self_after.ru_maxrss;
+    out_flush();
+    fprintf(stderr, "\nreal\t%dm%.3fs\nuser\t%dm%.3fs\nsys\t%dm%.3fs\nmaxrss\t%ld KB\n",
+            (int)(real / 60), real - 60 * (int)(real / 60), (int)(user / 60),
+            user - 60 * (int)(user / 60), (int)(sys / 60), sys - 60 * (int)(sys / 60), maxrss);
+    return last_status;
+}
+
+int dispatch_command(Command* cmd) {
+    switch (cmd->kind) {
+        case CMD_EMPTY:
+            break;
+        case CMD_ASSIGN:
+            // $? is that of the last $(...) in the value, if any
+            last_status = 0;
+            set_variable(cmd->name, expand_word(cmd->value));
+            break;
+        case CMD_INVALID:
+            fprintf(stderr, "Invalid pipe command\n");
+            last_status = 2;
+            break;
+        case CMD_REPEAT: {
+            // Check if the user wants to repeat a command using `!number`
+            history_load();
+            unsigned long n;
+            if (cmd->text[1] == '-') {
+                // !-k is the k-th most recent command, !- alone the last one
+                unsigned long back = cmd->text[2] ? strtoul(&cmd->text[2], NULL, 10) : 1;
+                n = back <= history_count ? history_count + 1 - back : 0;
+            } else {
+                n = strtoul(&cmd->text[1], NULL, 10);
+            }
+            char* entry = history_entry(n);
+            if (entry == NULL || entry[0] == '!') {
+                out_printf("Invalid history number!\n");
+                last_status = 1;
+                break;
+            }
+            out_printf("Repeating command: %s\n", entry);
+            Command repeated;
+            parse_command(&cmd_arena, arena_strdup(&cmd_arena, entry), &repeated);
+            return run_command(&repeated);
+        }
+        case CMD_PIPELINE: {
+            // Expand $variables into scratch copies; the parsed stages
+            // are left as written so the command can run again
+            unsigned long long start = trace_begin();
+            Stage* stages = arena_alloc(&cmd_arena, sizeof(Stage) * cmd->nstages);
+            for (int i = 0; i < cmd->nstages; i++) {
+                stages[i].argv = expand_argv(cmd->stages[i].argv);
+                stages[i].infile = cmd->stages[i].infile ? expand_word(cmd->stages[i].infile) : NULL;
+                stages[i].outfile = cmd->stages[i].outfile ? expand_word(cmd->stages[i].outfile) : NULL;
+            }
+            trace_span("expand", cmd->text, start, 0, -1);
+            // `run [options] cmd...` places every process the command starts.
+            // With a job instead of a command, or bad options, the run
+            // builtin changes the live job or reports the problem.
+            Placement place;
+            const Placement* where = NULL;
+            if (strcmp(stages[0].argv[0], "run") == 0) {
+                int first = placement_parse(stages[0].argv, &place, 1);
+                if (first > 0 && stages[0].argv[first] != NULL && !run_targets_job(stages[0].argv + first)) {
+                    stages[0].argv += first;
+                    where = &place;
+                }
+            }
+            // Foreground commands are timed into the histogram of their
+            // name; a pipeline's name is its stage names joined by |
+            start = now_ns();
+            if (cmd->nstages > 1) {
+                handle_pipe(stages, cmd->nstages, cmd->background, cmd->text, where);
+                if (cmd->background) break;
+                size_t len = 0;
+                for (int i = 0; i < cmd->nstages; i++) len += strlen(stages[i].argv[0]) + 1;
+                char* name = arena_alloc(&cmd_arena, len);
+                name[0] = '\0';
+                for (int i = 0; i < cmd->nstages; i++) {
+                    if (i > 0) strcat(name, "|");
+                    strcat(name, stages[i].argv[0]);
+                }
+                stats_record(name, now_ns() - start);
+                break;
+            }
+            // Builtins run in the shell itself unless they are sent to
+            // the background or placed, and do not need the shell's state
+            const Builtin* b = find_builtin(stages[0].argv[0]);
+            if (b != NULL && where != NULL && (b->flags & BUILTIN_PARENT)) {
+                fprintf(stderr, "run: %s: runs inside the shell and cannot be placed\n", b->name);
+                last_status = 2;
+                break;
+            }
+            if (b != NULL && ((!cmd->background && where == NULL) || (b->flags & BUILTIN_PARENT))) {
+                int saved[2];
+                if (redirect_begin(stages[0].infile, stages[0].outfile, saved) < 0) {
+                    last_status = 1;
+                    break;
+                }
+                execute_builtin(stages[0].argv);
+                redirect_end(saved);
+            } else {
+                execute(&stages[0], cmd->background, cmd->text, where);
+                if (cmd->background) break;
+            }
+            stats_record(stages[0].argv[0], now_ns() - start);
+            break;
+        }
+    }
+    return last_status;
+}
+
+// Point fd 0/1 at a builtin's redirection files, keeping the shell's own
+// descriptors in saved[] for redirect_end(). Nothing forks.
+int redirect_begin(const char* infile, const char* outfile, int saved[2]) {
+    saved[0] = saved[1] = -1;
+    if (infile != NULL) {
+        int fd = open(infile, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            perror("Failed to open input file");
+            return -1;
+        }
+        saved[0] = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 10);
+        dup2(fd, STDIN_FILENO);
+        close(fd);
+        stdin_redirected = 1;
+    }
+    if (outfile != NULL) {
+        int fd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            perror("Failed to open output file");
+            redirect_end(saved);
+            return -1;
+        }
+        out_flush();
+        saved[1] = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+        dup2(fd, STDOUT_FILENO);
+        close(fd);
+    }
+    return 0;
+}
+
+void redirect_end(int saved[2]) {
+    if (saved[1] >= 0) {
+        out_flush();
+        dup2(saved[1], STDOUT_FILENO);
+        close(saved[1]);
+    }
+    if (saved[0] >= 0) {
+        dup2(saved[0], STDIN_FILENO);
+        close(saved[0]);
+        stdin_redirected = 0;
+    }
+}
+
+int builtin_source(char** arglist) {
+    if (arglist[1] == NULL) {
+        fprintf(stderr, "source: missing file name\n");
+        return 2;
+    }
+    Script* script = load_script(arglist[1]);
+    if (script == NULL) {
+        fprintf(stderr, "source: %s: %s\n", arglist[1], strerror(errno));
+        return 1;
+    }
+    return run_script(script);
+}
+
+// Trim whitespace from both ends of a string
+// Returns the first non-blank character; the end is cut in place
+char* trim_whitespace(char* str) {
+    while (isspace((unsigned char)*str)) str++;
+    if (*str == 0) return str;
+    char* end = str + strlen(str) - 1;
+    while (end > str && isspace((unsigned char)*end)) end--;
+    *(end + 1) = '\0';
+    return str;
+}
+
+// Set up an empty ring for $HISTSIZE entries and decide where the history
+// file lives: $HISTFILE, or ~/.myshell_history. An empty $HISTFILE turns
+// persistence off.
+void history_init(const char* size) {
+    unsigned long n = size != NULL ? strtoul(size, NULL, 10) : HISTORY_SIZE;
+    history_resize(n);
+
+    char* file = getenv("HISTFILE");
+    if (file != NULL) {
+        if (*file != '\0') history_path = strdup(file);
+    } else if (getenv("HOME") != NULL) {
+        history_path = malloc(strlen(getenv("HOME")) + sizeof(HISTORY_FILE) + 1);
+        sprintf(history_path, "%s/%s", getenv("HOME"), HISTORY_FILE);
+    }
+}
+
+// Resize the ring to the next power of two >= size, keeping the newest entries
+void history_resize(unsigned long size) {
+    if (size < 1) size = 1;
+    if (size > MAX_HISTORY_SIZE) size = MAX_HISTORY_SIZE;
+    unsigned long cap = 1;
+    while (cap < size) cap <<= 1;
+    if (history != NULL && cap == history_mask + 1) return;
+
+    char** ring = calloc(cap, sizeof(char*));
+    unsigned long oldcap = history != NULL ? history_mask + 1 : 0;
+    unsigned long kept = history_count < oldcap ? history_count : oldcap;
+    for (unsigned long i = 0; i < kept; i++) {
+        unsigned long n = history_count - i;  // newest first
+        char* entry = history[(n - 1) & history_mask];
+        if (i < cap) ring[(n - 1) & (cap - 1)] = entry;
+        else if (!history_is_mapped(entry)) free(entry);
+    }
+    free(history);
+    history = ring;
+    history_mask = cap - 1;
+}
+
+int history_is_mapped(const char* entry) {
+    return history_map != NULL && entry >= history_map && entry < history_map + history_map_len;
+}
+
+// Command number n, or NULL if it was never entered or has left the ring
+char* history_entry(unsigned long n) {
+    if (n == 0 || n > history_count || history_count - n > history_mask) return NULL;
+    return history[(n - 1) & history_mask];
+}
+
+// Add command to history
+// O(1): the command goes into the next ring slot and is appended to the
+// history file with a single write.
+void add_to_history(char* command) {
+    if (command[0] == '\0') return;
+    // Collapse runs of the same command into one entry
+    char* last = history_entry(history_count);
+    if (last != NULL && strcmp(last, command) == 0) return;
+
+    if (history_path != NULL && !history_write_failed) {
+        if (history_fd < 0)
+            history_fd = open(history_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+        struct iovec iov[2] = { { command, strlen(command) }, { "\n", 1 } };
+        if (history_fd < 0 || writev(history_fd, iov, 2) < 0) history_write_failed = 1;
+    }
+
+    char** slot = &history[history_count & history_mask];
+    if (*slot != NULL && !history_is_mapped(*slot)) free(*slot);
+    *slot = strdup(command);
+    history_count++;
+}
+
+// Bring in the history file the first time history is actually looked at.
+// The file is mapped privately and each newline overwritten with a NUL, so
+// ring entries point straight into the mapping and only the pages holding
+// the newest entries are ever copied. Everything added this session has
+// already been appended to the file, so the file alone rebuilds the ring.
+void history_load() {
+    if (history_loaded) return;
+    history_loaded = 1;
+    if (history_path == NULL || history_write_failed) return;
+
+    int fd = open(history_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return;
+    }
+    char* map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return;
+
+    // Only whole lines count; a torn final line is ignored
+    size_t len = st.st_size;
+    while (len > 0 && map[len - 1] != '\n') len--;
+    unsigned long lines = 0;
+    for (char* p = map; (p = memchr(p, '\n', map + len - p)) != NULL; p++) lines++;
+
+    for (unsigned long i = 0; i <= history_mask; i++) {
+        free(history[i]);
+        history[i] = NULL;
+    }
+    history_map = map;
+    history_map_len = st.st_size;
+    history_count = lines;
+
+    // Walk back from the end, filling the ring newest first
+    char* end = map + len;
+    for (unsigned long n = lines; n > 0 && lines - n <= history_mask; n--) {
+        char* nl = end - 1;
+        *nl = '\0';
+        char* start = nl;
+        while (start > map && start[-1] != '\n') start--;
+        history[(n - 1) & history_mask] = start;
+        end = start;
+    }
+}
+
+int builtin_history(char** arglist) {
+    history_load();
+    // history -s QUERY / -p PREFIX: what Ctrl-R / the inline suggestion would show
+    if (arglist[1] != NULL && (strcmp(arglist[1], "-s") == 0 || strcmp(arglist[1], "-p") == 0)) {
+        char query[MAX_LEN] = "";
+        for (int i = 2; arglist[i] != NULL; i++) {
+            if (i > 2) strncat(query, " ", sizeof(query) - strlen(query) - 1);
+            strncat(query, arglist[i], sizeof(query) - strlen(query) - 1);
+        }
+        char* match;
+        // The search itself is already the newest entry, so start below it
+        if (arglist[1][1] == 's') match = history_entry(history_search(query, history_count));
+        else match = history_suggest(query);
+        if (match == NULL) return 1;
+        out_printf("%s\n", match);
+        return 0;
+    }
+    unsigned long shown = history_mask + 1;
+    if (arglist[1] != NULL) shown = strtoul(arglist[1], NULL, 10);
+    if (shown > history_count) shown = history_count;
+    if (shown > history_mask + 1) shown = history_mask + 1;
+    for (unsigned long n = history_count - shown + 1; n <= history_count; n++) {
+        out_printf("%5lu  %s\n", n, history_entry(n));
+    }
+    return 0;
+}
+
+unsigned int trigram_bucket(const char* p) {
+    unsigned int t = ((unsigned char)p[0] << 16) | ((unsigned char)p[1] << 8) | (unsigned char)p[2];
+    return (t * 2654435761u) >> 16;
+}
+
+unsigned long* history_freq_slot(unsigned long h) {
+    if (history_freq_cap == 0) return NULL;
+    size_t i = h & (history_freq_cap - 1);
+    while (history_freq[i].hash != 0 && history_freq[i].hash != h) i = (i + 1) & (history_freq_cap - 1);
+    return history_freq[i].hash == h ? &history_freq[i].count : NULL;
+}
+
+unsigned long history_frequency(const char* entry) {
+    unsigned long* count = history_freq_slot(hash_string(entry) | 1);
+    return count != NULL ? *count : 0;
+}
+
+// Append command number n to a posting list, once
+void posting_add(Posting* pl, unsigned long n, unsigned long oldest) {
+    if (pl->last == n) return;
+    if (pl->cap - pl->len < 5) {
+        // Drop numbers that have left the ring before growing the list
+        unsigned int pos = 0, next = 0, dropped = 0;
+        unsigned long id = 0, d = 0;
+        while (pos < pl->len) {
+            next = pos;
+            d = 0;
+            for (int shift = 0;; shift += 7) {
+                d |= (unsigned long)(pl->bytes[next] & 0x7f) << shift;
+                if (!(pl->bytes[next++] & 0x80)) break;
+            }
+            if (id + d >= oldest) break;
+            id += d;
+            pos = next;
+            dropped++;
+        }
+        if (pos == pl->len) {
+            pl->len = 0;
+            pl->n = 0;
+            pl->last = 0;
+        } else if (pos * 2 >= pl->len && pos > 0) {
+            // The first number kept is written out in full
+            unsigned char head[5];
+            unsigned int k = 0;
+            for (unsigned long v = id + d;; v >>= 7) {
+                head[k++] = (v & 0x7f) | (v >= 0x80 ? 0x80 : 0);
+                if (v < 0x80) break;
+            }
+            memmove(pl->bytes + k, pl->bytes + next, pl->len - next);
+            memcpy(pl->bytes, head, k);
+            pl->len = k + pl->len - next;
+            pl->n -= dropped;
+        }
+        if (pl->cap - pl->len < 5) {
+            pl->cap = pl->cap ? pl->cap + pl->cap / 2 : 8;
+            pl->bytes = realloc(pl->bytes, pl->cap);
+        }
+    }
+    for (unsigned long d = n - pl->last;; d >>= 7) {
+        pl->bytes[pl->len++] = (d & 0x7f) | (d >= 0x80 ? 0x80 : 0);
+        if (d < 0x80) break;
+    }
+    pl->last = n;
+    pl->n++;
+}
+
+// Walking a posting list newest first: from number n, whose bytes end at
+// *pos, to the one before it. Returns 0 and leaves *pos at 0 past the oldest.
+unsigned long posting_prev(const Posting* pl, unsigned int* pos, unsigned long n) {
+    unsigned int start = *pos - 1;
+    while (start > 0 && (pl->bytes[start - 1] & 0x80)) start--;
+    unsigned long d = 0;
+    for (unsigned int i = *pos; i > start; i--) d = (d << 7) | (pl->bytes[i - 1] & 0x7f);
+    *pos = start;
+    return n - d;
+}
+
+// Index one history entry: its number goes on the posting list of every
+// trigram it contains, and its frequency count goes up. Numbers only grow, so
+// posting lists stay sorted and a repeated trigram is just a repeated tail.
+void history_index_add(unsigned long n, const char* entry) {
+    size_t len = strlen(entry);
+    unsigned long oldest = history_count > history_mask ? history_count - history_mask : 1;
+    for (size_t i = 0; i + 3 <= len; i++) {
+        posting_add(&trigram_index[trigram_bucket(entry + i)], n, oldest);
+    }
+    unsigned long h = hash_string(entry) | 1;  // 0 marks an empty slot
+    if ((history_freq_count + 1) * 2 > history_freq_cap) {
+        size_t newcap = history_freq_cap ? history_freq_cap * 2 : 1024;
+        HistoryFreq* table = calloc(newcap, sizeof(HistoryFreq));
+        for (size_t i = 0; i < history_freq_cap; i++) {
+            if (history_freq[i].hash == 0) continue;
+            size_t j = history_freq[i].hash & (newcap - 1);
+            while (table[j].hash != 0) j = (j + 1) & (newcap - 1);
+            table[j] = history_freq[i];
+        }
+        free(history_freq);
+        history_freq = table;
+        history_freq_cap = newcap;
+    }
+    unsigned long* count = history_freq_slot(h);
+    if (count == NULL) {
+        size_t i = h & (history_freq_cap - 1);
+        while (history_freq[i].hash != 0) i = (i + 1) & (history_freq_cap - 1);
+        history_freq[i].hash = h;
+        count = &history_freq[i].count;
+        history_freq_count++;
+    }
+    (*count)++;
+}
+
+// Index up to limit more entries of the ring, oldest first, loading the
+// file if that has not happened yet. Returns 1 once the index is current.
+int history_index_step(unsigned long limit) {
+    history_load();
+    if (trigram_index == NULL) trigram_index = calloc(TRIGRAM_BUCKETS, sizeof(Posting));
+    unsigned long first = history_count > history_mask ? history_count - history_mask : 1;
+    if (history_indexed < first - 1) history_indexed = first - 1;
+    for (; limit > 0 && history_indexed < history_count; limit--) {
+        history_indexed++;
+        history_index_add(history_indexed, history_entry(history_indexed));
+    }
+    return history_indexed == history_count;
+}
+
+// Bring the index up to date; normally the idle prompt already has
+void history_index_build() {
+    history_index_step(history_count);
+}
+
+// Posting list to drive a search for query: that of its rarest trigram.
+// NULL means the query is too short to use the index.
+Posting* history_candidates(const char* query) {
+    history_load();
+    size_t len = strlen(query);
+    if (len < 3) return NULL;
+    history_index_build();
+    Posting* best = &trigram_index[trigram_bucket(query)];
+    for (size_t i = 1; i + 3 <= len; i++) {
+        Posting* pl = &trigram_index[trigram_bucket(query + i)];
+        if (pl->n < best->n) best = pl;
+    }
+    return best;
+}
+
+// Number of the newest command before `before` containing query, or 0. A
+// query under three bytes only looks through the HISTORY_SHORT_SCAN entries
+// before `before`; one more byte brings in the index and the whole ring.
+unsigned long history_search(const char* query, unsigned long before) {
+    Posting* pl = history_candidates(query);
+    unsigned long oldest = history_count > history_mask ? history_count - history_mask : 1;
+    if (pl == NULL) {
+        if (before > HISTORY_SHORT_SCAN && before - HISTORY_SHORT_SCAN > oldest)
+            oldest = before - HISTORY_SHORT_SCAN;
+        for (unsigned long n = before - 1; n >= oldest && n > 0; n--) {
+            if (strstr(history_entry(n), query) != NULL) return n;
+        }
+        return 0;
+    }
+    unsigned int pos = pl->len;
+    for (unsigned long n = pl->last; pos > 0; n = posting_prev(pl, &pos, n)) {
+        if (n >= before) continue;
+        if (n < oldest) break;
+        if (strstr(history_entry(n), query) != NULL) return n;
+    }
+    return 0;
+}
+
+// Best completion of prefix for the inline suggestion. The newest
+// SUGGEST_CANDIDATES matches are scored by frequency, discounted by age.
+// Under three bytes, only the newest HISTORY_SHORT_SCAN entries are looked at.
+char* history_suggest(const char* prefix) {
+    size_t len = strlen(prefix);
+    if (len == 0) return NULL;
+    Posting* pl = history_candidates(prefix);
+    unsigned long oldest = history_count > history_mask ? history_count - history_mask : 1;
+    if (pl == NULL && history_count > HISTORY_SHORT_SCAN && history_count - HISTORY_SHORT_SCAN >= oldest)
+        oldest = history_count - HISTORY_SHORT_SCAN + 1;
+    char* best = NULL;
+    double best_score = 0;
+    int seen = 0;
+    unsigned int pos = pl != NULL ? pl->len : 0;
+    unsigned long n = pl != NULL ? pl->last : history_count;
+    while (seen < SUGGEST_CANDIDATES && n >= oldest && n > 0) {
+        char* entry = history_entry(n);
+        unsigned long age = history_count - n;
+        n = pl != NULL ? (pos > 0 ? posting_prev(pl, &pos, n) : 0) : n - 1;
+        if (strncmp(entry, prefix, len) != 0 || entry[len] == '\0') continue;
+        seen++;
+        double score = (double)history_frequency(entry) / (1.0 + age / 64.0);
+        if (best == NULL || score > best_score) {
+            best = entry;
+            best_score = score;
+        }
+    }
+    return best;
+}
+
+// Bytes that end or change the meaning of a run of word characters: blanks,
+// operators, quotes, the escape and the substitution starters
+const unsigned char lex_special[256] = {
+    ['\t'] = 1, [' '] = 1, ['"'] = 1, ['$'] = 1, ['&'] = 1, ['\''] = 1, [';'] = 1,
+    ['<'] = 1, ['>'] = 1, ['\\'] = 1, ['`'] = 1, ['|'] = 1,
+};
+
+const char* lex_scan_scalar(const char* p, const char* end) {
+    while (p < end && !lex_special[(unsigned char)*p]) p++;
+    return p;
+}
+
+#ifdef __SSE2__
+// 16 bytes at a time. SSE2 has no byte shuffle for a table lookup, so
+// blank, tab and the ten other specials are compared for one by one
+const char* lex_scan_sse2(const char* p, const char* end) {
+    const __m128i c0 = _mm_set1_epi8('\t'), c1 = _mm_set1_epi8(' '), c2 = _mm_set1_epi8('"');
+    const __m128i c3 = _mm_set1_epi8('$'), c4 = _mm_set1_epi8('&'), c5 = _mm_set1_epi8('\'');
+    const __m128i c6 = _mm_set1_epi8(';'), c7 = _mm_set1_epi8('<'), c8 = _mm_set1_epi8('>');
+    const __m128i c9 = _mm_set1_epi8('\\'), c10 = _mm_set1_epi8('`'), c11 = _mm_set1_epi8('|');
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        __m128i a = _mm_or_si128(_mm_cmpeq_epi8(v, c0), _mm_cmpeq_epi8(v, c1));
+        __m128i b = _mm_or_si128(_mm_cmpeq_epi8(v, c2), _mm_cmpeq_epi8(v, c3));
+        __m128i c = _mm_or_si128(_mm_cmpeq_epi8(v, c4), _mm_cmpeq_epi8(v, c5));
+        __m128i d = _mm_or_si128(_mm_cmpeq_epi8(v, c6), _mm_cmpeq_epi8(v, c7));
+        __m128i e = _mm_or_si128(_mm_cmpeq_epi8(v, c8), _mm_cmpeq_epi8(v, c9));
+        __m128i f = _mm_or_si128(_mm_cmpeq_epi8(v, c10), _mm_cmpeq_epi8(v, c11));
+        __m128i hit = _mm_or_si128(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d)),
+                                   _mm_or_si128(e, f));
+        unsigned mask = _mm_movemask_epi8(hit);
+        if (mask != 0) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+    return lex_scan_scalar(p, end);
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+// 32 bytes at a time with two table lookups instead of twelve compares. Each
+// bit of hi_table stands for one high nibble that has specials; lo_table
+// sets that bit for the low nibbles that complete one. A byte is special
+// exactly when the two lookups share a bit.
+__attribute__((target("avx2")))
+const char* lex_scan_avx2(const char* p, const char* end) {
+    const __m256i lo_table = _mm256_setr_epi8(
+        0x12, 0, 0x02, 0, 0x02, 0, 0x02, 0x02, 0, 0x01, 0, 0x04, 0x2c, 0, 0x04, 0,
+        0x12, 0, 0x02, 0, 0x02, 0, 0x02, 0x02, 0, 0x01, 0, 0x04, 0x2c, 0, 0x04, 0);
+    const __m256i hi_table = _mm256_setr_epi8(
+        0x01, 0, 0x02, 0x04, 0, 0x08, 0x10, 0x20, 0, 0, 0, 0, 0, 0, 0, 0,
+        0x01, 0, 0x02, 0x04, 0, 0x08, 0x10, 0x20, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)p);
+        __m256i lo = _mm256_shuffle_epi8(lo_table, _mm256_and_si256(v, nibble));
+        __m256i hi = _mm256_shuffle_epi8(hi_table, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+        __m256i plain = _mm256_cmpeq_epi8(_mm256_and_si256(lo, hi), _mm256_setzero_si256());
+        unsigned mask = ~(unsigned)_mm256_movemask_epi8(plain);
+        if (mask != 0) return p + __builtin_ctz(mask);
+        p += 32;
+    }
+#ifdef __SSE2__
+    return lex_scan_sse2(p, end);
+#else
+    return lex_scan_scalar(p, end);
+#endif
+}
+#endif
+
+// The first special byte in [p, end), or end. Most words are short, so the
+// first few bytes are looked at one by one before any vector load.
+const char* lex_scan(const char* p, const char* end) {
+    for (const char* stop = end - p > 8 ? p + 8 : end; p < stop; p++) {
+        if (lex_special[(unsigned char)*p]) return p;
+    }
+    if (p == end) return p;
+    if (lex_isa < 0) {
+        lex_isa = LEX_SCALAR;
+#if defined(__x86_64__) || defined(__i386__)
+#ifdef __SSE2__
+        lex_isa = LEX_SSE2;
+#endif
+        if (__builtin_cpu_supports("avx2")) lex_isa = LEX_AVX2;
+#endif
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    if (lex_isa == LEX_AVX2) return lex_scan_avx2(p, end);
+#endif
+#ifdef __SSE2__
+    if (lex_isa == LEX_SSE2) return lex_scan_sse2(p, end);
+#endif
+    return lex_scan_scalar(p, end);
+}
+
+// The end of the word starting at p: the first blank or operator that is
+// not quoted, escaped or inside a $(...) or `...`. Runs of plain characters
+// are skipped by lex_scan(); the line must be NUL-terminated at end.
+const char* lex_word(const char* p, const char* end) {
+    for (;;) {
+        p = lex_scan(p, end);
+        if (p == end) return end;
+        switch (*p) {
+            case '\'': {
+                const char* close = memchr(p + 1, '\'', end - p - 1);
+                p = close != NULL ? close + 1 : end;
+                break;
+            }
+            case '"':
+                for (p++; p < end && *p != '"'; p++) {
+                    if (*p == '\\' && p + 1 < end) p++;
+                    else if (*p == '`' || (p[0] == '$' && p[1] == '(')) p = skip_substitution(p) - 1;
+                }
+                if (p < end) p++;
+                break;
+            case '\\':
+                p = p + 1 < end ? p + 2 : end;
+                break;
+            case '`':
+                p = skip_substitution(p);
+                break;
+            case '$':
+                p = p[1] == '(' ? skip_substitution(p) : p + 1;
+                break;
+            default:
+                return p;
+        }
+    }
+}
+
+// Split a line into spans in one pass: words (with their quotes, escapes
+// and substitutions) and the operators | < > & ;. Nothing is copied and
+// there is no limit on the number or length of words.
+Span* lex_line(Arena* a, const char* line, size_t len, size_t* count) {
+    unsigned long long start = trace_begin();
+    size_t cap = 16, n = 0;
+    Span* spans = arena_alloc(a, sizeof(Span) * cap);
+    const char* p = line;
+    const char* end = line + len;
+    for (;;) {
+        while (p < end && (*p == ' ' || *p == '\t')) p++;
+        if (p == end) break;
+        if (n == cap) {
+            Span* bigger = arena_alloc(a, sizeof(Span) * cap * 2);
+            memcpy(bigger, spans, sizeof(Span) * cap);
+            spans = bigger;
+            cap *= 2;
+        }
+        Span* s = &spans[n++];
+        s->offset = p - line;
+        s->length = 1;
+        switch (*p) {
+            case '|': s->kind = TOK_PIPE; p++; continue;
+            case '<': s->kind = TOK_IN; p++; continue;
+            case '>': s->kind = TOK_OUT; p++; continue;
+            case '&': s->kind = TOK_AMP; p++; continue;
+            case ';': s->kind = TOK_SEMI; p++; continue;
+        }
+        s->kind = TOK_WORD;
+        p = lex_word(p, end);
+        s->length = p - line - s->offset;
+    }
+    *count = n;
+    trace_span("lex", line, start, 0, -1);
+    return spans;
+}
+
+// Read command input
+// The returned line is only valid until the next call and must not be freed
+char* read_cmd(char* prompt, FILE* fp) {
+    unsigned long long start = trace_begin();
+    char* line;
+    if (interactive && fp == stdin) {
+        line = edit_line(prompt);
+    } else {
+        out_printf("%s", prompt);
+        if (stdin_reader.fd != fileno(fp)) reader_init(&stdin_reader, fileno(fp));
+        line = reader_next_line(&stdin_reader, NULL);
+    }
+    trace_span("read", NULL, start, 0, -1);
+    return line;
+}
+
+// One keypress from the terminal, with arrow-key escape sequences decoded
+int read_key() {
+    unsigned char c;
+    // Index history while no key is waiting, so that a keystroke does not
+    // have to: the file is loaded and indexed before the first one arrives
+    struct pollfd key = { STDIN_FILENO, POLLIN, 0 };
+    while (!history_index_step(HISTORY_INDEX_SLICE) && poll(&key, 1, 0) == 0);
+    for (;;) {
+        wait_for_input(STDIN_FILENO);
+        ssize_t n = read(STDIN_FILENO, &c, 1);
+        if (n == 1) break;
+        if (n < 0 && errno == EINTR) continue;
+        return -1;
+    }
+    if (c != 27) return c;
+    unsigned char seq[3];
+    if (read(STDIN_FILENO, seq, 1) != 1 || (seq[0] != '[' && seq[0] != 'O')) return 27;
+    if (read(STDIN_FILENO, seq + 1, 1) != 1) return 27;
+    switch (seq[1]) {
+        case 'A': return KEY_UP;
+        case 'B': return KEY_DOWN;
+        case 'C': return KEY_RIGHT;
+        case 'D': return KEY_LEFT;
+        case 'H': return KEY_HOME;
+        case 'F': return KEY_END;
+    }
+    if (seq[1] >= '0' && seq[1] <= '9') {
+        if (read(STDIN_FILENO, seq + 2, 1) != 1 || seq[2] != '~') return 27;
+        if (seq[1] == '1' || seq[1] == '7') return KEY_HOME;
+        if (seq[1] == '4' || seq[1] == '8') return KEY_END;
+        if (seq[1] == '3') return KEY_DELETE;
+    }
+    return 27;
+}
+
+void edit_insert(const char* text, size_t n) {
+    if (edit.len + n + 1 > edit.cap) {
+        while (edit.len + n + 1 > edit.cap) edit.cap = edit.cap ? edit.cap * 2 : 256;
+        edit.buf = realloc(edit.buf, edit.cap);
+    }
+    memmove(edit.buf + edit.pos + n, edit.buf + edit.pos, edit.len - edit.pos);
+    memcpy(edit.buf + edit.pos, text, n);
+    edit.len += n;
+    edit.pos += n;
+    edit.buf[edit.len] = '\0';
+}
+
+void edit_set(const char* text) {
+    edit.len = 0;
+    edit.pos = 0;
+    if (edit.buf != NULL) edit.buf[0] = '\0';
+    edit_insert(text, strlen(text));
+}
+
+// Redraw the prompt line. With the cursor at the end, the best history match
+// for what has been typed is shown dimmed after it; returns that match.
+char* edit_refresh(const char* prompt) {
+    char* suggestion = NULL;
+    if (edit.pos == edit.len && edit.len > 0) suggestion = history_suggest(edit.buf);
+    printf("\r%s%s", prompt, edit.len > 0 ? edit.buf : "");
+    if (suggestion != NULL) printf("\033[90m%s\033[0m", suggestion + edit.len);
+    printf("\033[K\r");
+    size_t col = strlen(prompt) + edit.pos;
+    if (col > 0) printf("\033[%zuC", col);
+    fflush(stdout);
+    return suggestion;
+}
+
+// Ctrl-R incremental search. Returns the key that ended the search; the
+// accepted match (if any) is left in the edit buffer.
+int edit_search() {
+    char query[MAX_LEN] = "";
+    size_t qlen = 0;
+    unsigned long match = 0;
+    int key;
+    for (;;) {
+        char* entry = match ? history_entry(match) : NULL;
+        printf("\r(reverse-i-search)`%s': %s\033[K", query, entry ? entry : "");
+        fflush(stdout);
+        key = read_key();
+        if (key == CTRL('r')) {
+            // Next older match with different text
+            unsigned long next = match ? match : history_count + 1;
+            while ((next = history_search(query, next)) != 0 &&
+                   entry != NULL && strcmp(history_entry(next), entry) == 0);
+            if (next != 0) match = next;
+            continue;
+        }
+        if (key == 127 || key == CTRL('h')) {
+            if (qlen > 0) query[--qlen] = '\0';
+        } else if (key >= 32 && key < 127 && qlen + 1 < sizeof(query)) {
+            query[qlen++] = key;
+            query[qlen] = '\0';
+        } else {
+            break;
+        }
+        match = qlen > 0 ? history_search(query, history_count + 1) : 0;
+    }
+    if (key == CTRL('g') || key == CTRL('c') || key == 27) {
+        edit_set("");
+        return key;
+    }
+    if (match != 0) edit_set(history_entry(match));
+    return key;
+}
+
+// Child of node for byte c, created in order if asked to
+unsigned trie_child(unsigned node, unsigned char c, int create) {
+    unsigned prev = 0, cur = exec_trie[node].child;
+    while (cur != 0 && exec_trie[cur].c < c) {
+        prev = cur;
+        cur = exec_trie[cur].sibling;
+    }
+    if (cur != 0 && exec_trie[cur].c == c) return cur;
+    if (!create) return 0;
+    if (exec_trie_len == exec_trie_cap) {
+        exec_trie_cap *= 2;
+        exec_trie = realloc(exec_trie, sizeof(TrieNode) * exec_trie_cap);
+        if (exec_trie == NULL) {
+            perror("realloc failed");
+            exit(1);
+        }
+    }
+    unsigned n = exec_trie_len++;
+    exec_trie[n] = (TrieNode){ 0, cur, 0, c, 0 };
+    if (prev != 0) exec_trie[prev].sibling = n;
+    else exec_trie[node].child = n;
+    return n;
+}
+
+// Record whether source bit (a PATH directory or COMPLETE_BUILTIN) provides
+// name. Nodes are never removed; live counts keep empty branches out of
+// completions.
+void trie_update(const char* name, int bit, int present) {
+    unsigned path[NAME_MAX + 1];
+    size_t depth = 0;
+    unsigned node = 0;
+    if (name[0] == '\0' || strlen(name) > NAME_MAX) return;
+    path[depth++] = 0;
+    for (const char* p = name; *p != '\0'; p++) {
+        node = trie_child(node, *p, present);
+        if (node == 0) return;
+        path[depth++] = node;
+    }
+    int was = exec_trie[node].dirs != 0;
+    if (present) exec_trie[node].dirs |= 1ULL << bit;
+    else exec_trie[node].dirs &= ~(1ULL << bit);
+    int is = exec_trie[node].dirs != 0;
+    if (was != is) {
+        for (size_t i = 0; i < depth; i++) exec_trie[path[i]].live += is ? 1 : -1;
+    }
+}
+
+// A regular file with an execute bit, as lookup_command() would accept
+int exec_check(int dirfd, const char* name) {
+    struct stat st;
+    return fstatat(dirfd, name, &st, 0) == 0 && S_ISREG(st.st_mode) && (st.st_mode & 0111);
+}
+
+// Build the trie from scratch for pathvar. Each directory is watched before
+// it is read, so nothing that changes during the scan is missed.
+void exec_trie_build(const char* pathvar) {
+    for (int i = 0; i < exec_ndirs; i++) free(exec_dirs[i]);
+    exec_ndirs = 0;
+    if (exec_inotify >= 0) close(exec_inotify);
+    exec_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    free(exec_trie_path);
+    exec_trie_path = strdup(pathvar);
+    if (exec_trie == NULL) {
+        exec_trie_cap = 4096;
+        exec_trie = malloc(sizeof(TrieNode) * exec_trie_cap);
+        if (exec_trie == NULL) {
+            perror("malloc failed");
+            exit(1);
+        }
+    }
+    exec_trie[0] = (TrieNode){ 0, 0, 0, 0, 0 };
+    exec_trie_len = 1;
+
+    char* dirbuf = malloc(GLOB_DIRBUF);
+    if (dirbuf == NULL) {
+        perror("malloc failed");
+        exit(1);
+    }
+    for (const char* dir = pathvar; exec_ndirs < COMPLETE_DIRS; dir++) {
+        const char* colon = strchr(dir, ':');
+        size_t len = colon ? (size_t)(colon - dir) : strlen(dir);
+        char* path = strndup(dir, len);
+        int seen = len == 0;
+        for (int i = 0; i < exec_ndirs && !seen; i++) seen = strcmp(exec_dirs[i], path) == 0;
+        int fd = seen ? -1 : open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd >= 0) {
+            int i = exec_ndirs++;
+            exec_dirs[i] = path;
+            path = NULL;
+            exec_watches[i] = exec_inotify < 0 ? -1 :
+                inotify_add_watch(exec_inotify, exec_dirs[i], IN_CREATE | IN_DELETE | IN_ATTRIB |
+                                  IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE);
+            ssize_t n;
+            while ((n = getdents64(fd, dirbuf, GLOB_DIRBUF)) > 0) {
+                for (ssize_t off = 0; off < n;) {
+                    struct dirent64* e = (struct dirent64*)(dirbuf + off);
+                    off += e->d_reclen;
+                    if (e->d_type != DT_DIR && exec_check(fd, e->d_name)) trie_update(e->d_name, i, 1);
+                }
+            }
+            close(fd);
+        }
+        free(path);
+        if (colon == NULL) break;
+        dir = colon;
+    }
+    free(dirbuf);
+    for (const Builtin* b = builtins; b->name != NULL; b++) trie_update(b->name, COMPLETE_BUILTIN, 1);
+}
+
+// Bring the trie up to date: apply what inotify saw since the last Tab, or
+// rebuild if $PATH changed or the event queue overflowed
+void exec_trie_sync() {
+    const char* pathvar = get_variable_value("PATH");
+    if (pathvar == NULL) pathvar = "/usr/local/bin:/usr/bin:/bin";
+    if (exec_trie_path == NULL || strcmp(exec_trie_path, pathvar) != 0) {
+        exec_trie_build(pathvar);
+        return;
+    }
+    char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while (exec_inotify >= 0 && (n = read(exec_inotify, buf, sizeof(buf))) > 0) {
+        for (char* p = buf; p < buf + n;) {
+            struct inotify_event* ev = (struct inotify_event*)p;
+            p += sizeof(struct inotify_event) + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                exec_trie_build(pathvar);
+                return;
+            }
+            int i = 0;
+            while (i < exec_ndirs && exec_watches[i] != ev->wd) i++;
+            if (i == exec_ndirs || ev->len == 0) continue;
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", exec_dirs[i], ev->name);
+            int present = !(ev->mask & (IN_DELETE | IN_MOVED_FROM)) && exec_check(AT_FDCWD, path);
+            trie_update(ev->name, i, present);
+        }
+    }
+}
+
+// Append a candidate: text[0..len) + name + suffix
+void completion_add(Completions* c, const char* text, size_t len, const char* name, const char* suffix) {
+    if (c->count == c->cap) {
+        size_t cap = c->cap ? c->cap * 2 : 64;
+        char** bigger = arena_alloc(&cmd_arena, sizeof(char*) * cap);
+        if (c->count > 0) memcpy(bigger, c->items, sizeof(char*) * c->count);
+        c->items = bigger;
+        c->cap = cap;
+    }
+    size_t nlen = strlen(name), slen = strlen(suffix);
+    char* item = arena_alloc(&cmd_arena, len + nlen + slen + 1);
+    memcpy(item, text, len);
+    memcpy(item + len, name, nlen);
+    memcpy(item + len + nlen, suffix, slen + 1);
+    c->items[c->count++] = item;
+}
+
+void trie_collect(unsigned node, char* name, size_t len, Completions* out) {
+    if (exec_trie[node].dirs != 0) {
+        name[len] = '\0';
+        completion_add(out, "", 0, name, " ");
+    }
+    for (unsigned c = exec_trie[node].child; c != 0; c = exec_trie[c].sibling) {
+        if (exec_trie[c].live == 0) continue;
+        name[len] = exec_trie[c].c;
+        trie_collect(c, name, len + 1, out);
+    }
+}
+
+// Commands and builtins starting with prefix, in order
+void complete_commands(const char* prefix, Completions* out) {
+    exec_trie_sync();
+    size_t len = strlen(prefix);
+    if (len > NAME_MAX) return;
+    unsigned node = 0;
+    for (size_t i = 0; i < len && (node = trie_child(node, prefix[i], 0)) != 0; i++);
+    if (len > 0 && node == 0) return;
+    char name[NAME_MAX + 1];
+    memcpy(name, prefix, len);
+    trie_collect(node, name, len, out);
+}
+
+int completion_compare(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+void complete_variables(const char* prefix, Completions* out) {
+    size_t len = strlen(prefix);
+    for (size_t i = 0; i < variable_count; i++) {
+        if (variables[i].value != NULL && strncmp(variables[i].name, prefix, len) == 0) {
+            completion_add(out, "$", 1, variables[i].name, " ");
+        }
+    }
+    if (out->count > 1) qsort(out->items, out->count, sizeof(char*), completion_compare);
+}
+
+// The cached listing of path, reread only when its mtime has moved
+DirListing* dir_listing(const char* path) {
+    struct stat st;
+    if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode)) return NULL;
+    DirListing* d = NULL;
+    for (int i = 0; i < DIR_CACHE && d == NULL; i++) {
+        if (dir_cache[i].path != NULL && strcmp(dir_cache[i].path, path) == 0) d = &dir_cache[i];
+    }
+    if (d != NULL && d->mtime.tv_sec == st.st_mtim.tv_sec && d->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        return d;
+    }
+    if (d == NULL) {
+        d = &dir_cache[dir_cache_next++ % DIR_CACHE];
+        free(d->path);
+        d->path = strdup(path);
+    }
+    if (d->names == NULL) d->names = chunk_new(ARENA_CHUNK);
+    d->names->used = 0;
+    d->mtime = st.st_mtim;
+
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    char* dirbuf = malloc(GLOB_DIRBUF);
+    if (dirbuf == NULL) {
+        perror("malloc failed");
+        exit(1);
+    }
+    ssize_t n;
+    while (fd >= 0 && (n = getdents64(fd, dirbuf, GLOB_DIRBUF)) > 0) {
+        for (ssize_t off = 0; off < n;) {
+            struct dirent64* e = (struct dirent64*)(dirbuf + off);
+            off += e->d_reclen;
+            if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+            capture_append(&d->names, glob_is_dir(fd, e, 1) ? "d" : "f", 1);
+            capture_append(&d->names, e->d_name, strlen(e->d_name) + 1);
+        }
+    }
+    free(dirbuf);
+    if (fd >= 0) close(fd);
+    return d;
+}
+
+void complete_files(const char* word, Completions* out) {
+    const char* slash = strrchr(word, '/');
+    size_t dirlen = slash != NULL ? (size_t)(slash - word + 1) : 0;
+    const char* prefix = word + dirlen;
+    size_t plen = strlen(prefix);
+    DirListing* d = dir_listing(dirlen > 0 ? arena_strndup(&cmd_arena, word, dirlen) : ".");
+    if (d == NULL) return;
+    for (char* p = d->names->data; p < d->names->data + d->names->used; p += strlen(p) + 1) {
+        const char* name = p + 1;
+        if (name[0] == '.' && prefix[0] != '.') continue;
+        if (strncmp(name, prefix, plen) == 0) completion_add(out, word, dirlen, name, p[0] == 'd' ? "/" : " ");
+    }
+    if (out->count > 1) qsort(out->items, out->count, sizeof(char*), completion_compare);
+}
+
+// Candidates for a word: $variables, commands when the word is in command
+// position and has no '/', file names otherwise
+void complete_word(const char* word, int command, Completions* out) {
+    unsigned long long start = trace_begin();
+    if (word[0] == '$') complete_variables(word + 1, out);
+    else if (command && strchr(word, '/') == NULL) complete_commands(word, out);
+    else complete_files(word, out);
+    trace_span("complete", word, start, 0, -1);
+}
+
+// Print candidates in columns under the prompt line
+void edit_list(Completions* c) {
+    struct winsize ws;
+    size_t width = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+    size_t shown = c->count < COMPLETE_LIST ? c->count : COMPLETE_LIST;
+    size_t widest = 1;
+    for (size_t i = 0; i < shown; i++) {
+        if (strlen(c->items[i]) > widest) widest = strlen(c->items[i]);
+    }
+    size_t cols = width / (widest + 1) > 0 ? width / (widest + 1) : 1;
+    printf("\n");
+    for (size_t i = 0; i < shown; i++) {
+        size_t len = strlen(c->items[i]);
+        if (c->items[i][len - 1] == ' ') len--;
+        printf("%-*.*s", (int)(widest + 1), (int)len, c->items[i]);
+        if ((i + 1) % cols == 0 || i + 1 == shown) printf("\n");
+    }
+    if (c->count > shown) printf("(%zu more)\n", c->count - shown);
+}
+
+// Tab: complete the word before the cursor. A single candidate is inserted
+// whole; several are narrowed to their common prefix, or listed when that
+// would add nothing.
+void edit_complete() {
+    size_t start = edit.pos;
+    while (start > 0 && strchr(" \t|;&<>(`", edit.buf[start - 1]) == NULL) start--;
+    size_t before = start;
+    while (before > 0 && (edit.buf[before - 1] == ' ' || edit.buf[before - 1] == '\t')) before--;
+    int command = before == 0 || strchr("|;&(`", edit.buf[before - 1]) != NULL;
+
+    ArenaMark mark = arena_mark(&cmd_arena);
+    char* word = arena_strndup(&cmd_arena, edit.buf + start, edit.pos - start);
+    Completions c = { NULL, 0, 0 };
+    complete_word(word, command, &c);
+    if (c.count > 0) {
+        size_t common = strlen(c.items[0]);
+        for (size_t i = 1; i < c.count; i++) {
+            size_t n = 0;
+            while (n < common && c.items[i][n] == c.items[0][n]) n++;
+            common = n;
+        }
+        if (c.count == 1 || common > strlen(word)) {
+            memmove(edit.buf + start, edit.buf + edit.pos, edit.len - edit.pos + 1);
+            edit.len -= edit.pos - start;
+            edit.pos = start;
+            edit_insert(c.items[0], common);
+        } else {
+            edit_list(&c);
+        }
+    }
+    arena_release(&cmd_arena, mark);
+}
+
+// Interactive line editor: raw-mode input with cursor movement, Up/Down
+// through history, Ctrl-R search, Tab completion and fish-style suggestions
+// accepted with Right arrow or Ctrl-F. Returns NULL on Ctrl-D at an empty line.
+char* edit_line(const char* prompt) {
+    struct termios saved, raw;
+    out_flush();
+    if (tcgetattr(STDIN_FILENO, &saved) < 0) {
+        printf("%s", prompt);
+        if (stdin_reader.fd != STDIN_FILENO) reader_init(&stdin_reader, STDIN_FILENO);
+        return reader_next_line(&stdin_reader, NULL);
+    }
+    raw = saved;
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+    raw.c_iflag &= ~(IXON | ICRNL);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+
+    edit_set("");
+    // Up/Down position, counted from the newest entry. Loading the file
+    // renumbers the ring, so the position starts over if that happens.
+    unsigned long newest = history_count;
+    unsigned long browsing = newest + 1;
+    char* result = edit.buf;
+    char* suggestion = edit_refresh(prompt);
+    for (;;) {
+        int key = read_key();
+        if (key == CTRL('r')) {
+            key = edit_search();
+            if (key != '\r' && key != '\n') {
+                suggestion = edit_refresh(prompt);
+                continue;
+            }
+        }
+        if (key == '\r' || key == '\n') {
+            break;
+        } else if (key == -1 || (key == CTRL('d') && edit.len == 0)) {
+            result = NULL;
+            break;
+        } else if (key == CTRL('c')) {
+            printf("^C\n");
+            edit_set("");
+        } else if (key == 127 || key == CTRL('h')) {
+            if (edit.pos > 0) {
+                memmove(edit.buf + edit.pos - 1, edit.buf + edit.pos, edit.len - edit.pos + 1);
+                edit.pos--;
+                edit.len--;
+            }
+        } else if (key == KEY_DELETE || key == CTRL('d')) {
+            if (edit.pos < edit.len) {
+                memmove(edit.buf + edit.pos, edit.buf + edit.pos + 1, edit.len - edit.pos);
+                edit.len--;
+            }
+        } else if (key == KEY_LEFT || key == CTRL('b')) {
+            if (edit.pos > 0) edit.pos--;
+        } else if (key == KEY_RIGHT || key == CTRL('f') || key == KEY_END || key == CTRL('e')) {
+            if (edit.pos < edit.len) {
+                edit.pos = key == KEY_RIGHT || key == CTRL('f') ? edit.pos + 1 : edit.len;
+            } else if (suggestion != NULL) {
+                edit_set(suggestion);
+            }
+        } else if (key == KEY_HOME || key == CTRL('a')) {
+            edit.pos = 0;
+        } else if (key == '\t') {
+            edit_complete();
+        } else if (key == CTRL('u')) {
+            edit_set("");
+        } else if (key == KEY_UP || key == CTRL('p')) {
+            history_load();
+            if (history_count != newest) {
+                newest = history_count;
+                browsing = newest + 1;
+            }
+            if (history_entry(browsing - 1) != NULL) edit_set(history_entry(--browsing));
+        } else if (key == KEY_DOWN || key == CTRL('n')) {
+            if (history_count != newest) {
+                newest = history_count;
+                browsing = newest + 1;
+            }
+            if (browsing <= history_count) {
+                browsing++;
+                edit_set(browsing <= history_count ? history_entry(browsing) : "");
+            }
+        } else if (key >= 32 && key < 127) {
+            char c = key;
+            edit_insert(&c, 1);
+        }
+        suggestion = edit_refresh(prompt);
+    }
+
+    // Leave the finished line on screen without the suggestion
+    edit.pos = edit.len;
+    printf("\r%s%s\033[K\n", prompt, edit.len > 0 ? edit.buf : "");
+    fflush(stdout);
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved);
+    return result != NULL ? edit.buf : NULL;
+}
+
+// Allocate n bytes from the arena, 16-byte aligned
+void* arena_alloc(Arena* a, size_t n) {
+    n = (n + 15) & ~(size_t)15;
+
+    // Requests too big for a regular chunk get their own block
+    if (n > ARENA_CHUNK / 2) {
+        ArenaChunk* big = malloc(sizeof(ArenaChunk) + n);
+        if (big == NULL) {
+            perror("malloc failed");
+            exit(1);
+        }
+        big->size = n;
+        big->used = n;
+        big->mapped = 0;
+        big->next = a->large;
+        a->large = big;
+        return big->data;
+    }
+
+    if (a->cur == NULL || a->cur->used + n > a->cur->size) {
+        if (a->cur != NULL && a->cur->next != NULL) {
+            // Reuse a chunk kept from an earlier, larger command
+            a->cur = a->cur->next;
+            a->cur->used = 0;
+        } else {
+            ArenaChunk* c = malloc(sizeof(ArenaChunk) + ARENA_CHUNK);
+            if (c == NULL) {
+                perror("malloc failed");
+                exit(1);
+            }
+            c->size = ARENA_CHUNK;
+            c->used = 0;
+            c->mapped = 0;
+            c->next = NULL;
+            if (a->cur != NULL) a->cur->next = c;
+            else a->head = c;
+            a->cur = c;
+        }
+    }
+    void* p = a->cur->data + a->cur->used;
+    a->cur->used += n;
+    return p;
+}
+
+char* arena_strndup(Arena* a, const char* s, size_t n) {
+    char* p = arena_alloc(a, n + 1);
+    memcpy(p, s, n);
+    p[n] = '\0';
+    return p;
+}
+
+char* arena_strdup(Arena* a, const char* s) {
+    return arena_strndup(a, s, strlen(s));
+}
+
+// Release everything allocated since the last reset. Regular chunks are kept
+// for reuse; only oversized blocks go back to the heap.
+void arena_reset(Arena* a) {
+    while (a->large != NULL) {
+        ArenaChunk* next = a->large->next;
+        chunk_free(a->large);
+        a->large = next;
+    }
+    a->cur = a->head;
+    if (a->cur != NULL) a->cur->used = 0;
+}
+
+ArenaMark arena_mark(Arena* a) {
+    ArenaMark m = { a->cur, a->cur != NULL ? a->cur->used : 0, a->large };
+    return m;
+}
+
+// Free everything allocated since m was taken
+void arena_release(Arena* a, ArenaMark m) {
+    while (a->large != m.large) {
+        ArenaChunk* next = a->large->next;
+        chunk_free(a->large);
+        a->large = next;
+    }
+    a->cur = m.cur != NULL ? m.cur : a->head;
+    if (a->cur != NULL) a->cur->used = m.used;
+}
+
+// A malloc'd chunk outside any arena, for buffers that grow with capture_append
+ArenaChunk* chunk_new(size_t size) {
+    ArenaChunk* c = malloc(sizeof(ArenaChunk) + size);
+    if (c == NULL) {
+        perror("malloc failed");
+        exit(1);
+    }
+    c->next = NULL;
+    c->size = size;
+    c->used = 0;
+    c->mapped = 0;
+    return c;
+}
+
+void chunk_free(ArenaChunk* c) {
+    if (c->mapped) munmap(c->data - CAPTURE_HEADER, c->size);
+    else free(c);
+}
+
+// Append to a growing capture buffer
+void capture_append(ArenaChunk** chunk, const char* data, size_t n) {
+    ArenaChunk* c = *chunk;
+    if (c->used + n + 1 > c->size) {
+        size_t size = c->size;
+        while (c->used + n + 1 > size) size *= 2;
+        c = realloc(c, sizeof(ArenaChunk) + size);
+        if (c == NULL) {
+            perror("realloc failed");
+            exit(1);
+        }
+        c->size = size;
+        *chunk = c;
+    }
+    memcpy(c->data + c->used, data, n);
+    c->used += n;
+}
+
+// Send bytes to stdout, or into the capture buffer of a $(builtin)
+void out_emit(const char* data, size_t len) {
+    if (out.capture != NULL) {
+        capture_append(out.capture, data, len);
+        return;
+    }
+    while (len > 0) {
+        ssize_t n = write(out.fd, data, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;  // the reader went away; drop the output
+        data += n;
+        len -= n;
+    }
+}
+
+void out_flush() {
+    fflush(stdout);
+    out_emit(out.buf, out.len);
+    out.len = 0;
+}
+
+void out_write(const char* data, size_t len) {
+    if (out.len + len > WRITE_BUFFER) out_flush();
+    if (len >= WRITE_BUFFER) {
+        out_emit(data, len);
+        return;
+    }
+    memcpy(out.buf + out.len, data, len);
+    out.len += len;
+}
+
+void out_printf(const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(out.buf + out.len, WRITE_BUFFER - out.len, fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if ((size_t)n < WRITE_BUFFER - out.len) {
+        out.len += n;
+        return;
+    }
+    // Did not fit: format into a temporary of the right size
+    char* tmp = malloc(n + 1);
+    va_start(ap, fmt);
+    vsnprintf(tmp, n + 1, fmt, ap);
+    va_end(ap);
+    out_write(tmp, n);
+    free(tmp);
+}
+
+void reader_init(LineReader* r, int fd) {
+    r->fd = fd;
+    if (r->buf == NULL) {
+        r->cap = READ_CHUNK;
+        r->buf = malloc(r->cap);
+    }
+    r->start = 0;
+    r->end = 0;
+    r->eof = 0;
+}
+
+// Return the next line with its newline replaced by NUL. Newlines are found
+// with memchr, which glibc vectorizes, and bytes are only moved when a line
+// straddles the end of the chunk. The buffer doubles for lines longer than it.
+char* reader_next_line(LineReader* r, size_t* lenp) {
+    size_t scanned = r->start;
+    for (;;) {
+        char* nl = memchr(r->buf + scanned, '\n', r->end - scanned);
+        if (nl != NULL) {
+            char* line = r->buf + r->start;
+            *nl = '\0';
+            if (lenp) *lenp = nl - line;
+            r->start = nl + 1 - r->buf;
+            return line;
+        }
+        if (r->eof) {
+            if (r->start == r->end) return NULL;
+            // Last line without a trailing newline; there is always room for the NUL
+            char* line = r->buf + r->start;
+            r->buf[r->end] = '\0';
+            if (lenp) *lenp = r->end - r->start;
+            r->start = r->end;
+            return line;
+        }
+
+        // Move the partial line to the front, then grow if it fills the buffer
+        if (r->start > 0) {
+            memmove(r->buf, r->buf + r->start, r->end - r->start);
+            r->end -= r->start;
+            r->start = 0;
+        }
+        scanned = r->end;
+        if (r->cap - r->end < READ_CHUNK / 4) {
+            r->cap *= 2;
+            r->buf = realloc(r->buf, r->cap);
+            if (r->buf == NULL) {
+                perror("realloc failed");
+                exit(1);
+            }
+        }
+
+        // Anything printed so far (e.g. the prompt) must be visible before blocking
+        out_flush();
+        wait_for_input(r->fd);
+        ssize_t n = read(r->fd, r->buf + r->end, r->cap - r->end - 1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("read failed");
+            r->eof = 1;
+        } else if (n == 0) {
+            r->eof = 1;
+        } else {
+            r->end += n;
+        }
+    }
+}
+
+// Execute command
+int execute(Stage* stage, int background, const char* text, const Placement* where) {
+    char** arglist = stage->argv;
+    Launch l = { arglist, stage->infile, stage->outfile, -1, -1, -1, 0, !background };
+    // set -o joblog: stdout and stderr go to a pipe the shell drains
+    JobLog* log = background && joblog_on ? joblog_new(text, &l.out_fd) : NULL;
+    l.err_fd = l.out_fd;
+
+    pid_t cpid = launch_process(&l);
+    if (log != NULL) close(l.out_fd);
+    if (cpid < 0) {
+        if (log != NULL) joblog_free(log);
+        last_status = 127;
+        return -1;
+    }
+    if (where != NULL && placement_apply(cpid, where) < 0) {
+        fprintf(stderr, "run: %d: %s\n", cpid, strerror(errno));
+    }
+    if (background) {
+        last_background = cpid;
+        Job* job = add_job(cpid, &cpid, 1, text);
+        if (where != NULL) job->place = *where;
+        if (log != NULL) joblog_attach(log, job->id);
+        out_printf("[%d] %d\n", job->id, cpid);
+        last_status = 0;
+        return 0;
+    }
+
+    int status;
+    struct rusage ru;
+    unsigned long long start = trace_begin();
+    while (wait4(cpid, &status, WUNTRACED, &ru) < 0 && errno == EINTR);
+    trace_span("wait", arglist[0], start, cpid, 0);
+    add_child_usage(&ru);
+    if (interactive) tcsetpgrp(STDIN_FILENO, getpgrp());
+    if (WIFSTOPPED(status)) {
+        job_stopped(cpid, &cpid, 1, text, status);
+        return 0;
+    }
+    // The child could not exec the cached path; resolve it again next time
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 127) path_cache_forget(arglist[0]);
+    last_status = pipeline_status(&status, 1);
+    return 0;
+}
+
+// Start a command with the selected backend. External commands are resolved
+// through the PATH cache here, before any child exists. Builtins running as
+// pipeline stages need a copy of the shell, so they always go through fork.
+pid_t launch_process(Launch* l) {
+    unsigned long long start = trace_begin();
+    // Keep our own buffered output ahead of anything the child writes
+    out_flush();
+    // Bring env_vec up to date here, once, rather than in every child
+    env_build();
+    pid_t pid;
+    if (is_builtin(l->argv[0])) {
+        pid = launch_fork(l);
+    } else {
+        l->path = lookup_command(l->argv[0]);
+        if (l->path == NULL) {
+            fprintf(stderr, "%s: command not found\n", l->argv[0]);
+            return -1;
+        }
+        if (launcher == LAUNCH_ZYGOTE) pid = launch_zygote(l);
+        else if (launcher == LAUNCH_SPAWN) pid = launch_spawn(l);
+        else pid = launch_fork(l);
+    }
+    const char* how = l->path == NULL || launcher == LAUNCH_FORK ? "fork"
+                      : launcher == LAUNCH_SPAWN ? "spawn" : "zygote";
+    trace_span(how, l->argv[0], start, pid, l->stage);
+    return pid;
+}
+
+// Start the fork server: this binary re-executed with --zygote and one end
+// of a SEQPACKET socket as fd 3. Its memory stays a few pages however large
+// the shell grows, so forking from it costs the same at any time.
+int zygote_start() {
+    if (zygote_fd >= 0) return 0;
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) return -1;
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa, sv[1], ZYGOTE_FD);
+    char* argv[] = { "myshell-zygote", "--zygote", NULL };
+    int err = posix_spawn(&zygote_pid, "/proc/self/exe", &fa, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    close(sv[1]);
+    if (err != 0) {
+        close(sv[0]);
+        errno = err;
+        return -1;
+    }
+    zygote_fd = sv[0];
+    return 0;
+}
+
+// Launch through the fork server. The zygote creates the child with
+// CLONE_PARENT, so it is our child: waitpid, pidfds and job control treat it
+// exactly like one we forked ourselves.
+pid_t launch_zygote(Launch* l) {
+    int argc = 0, envc = 0;
+    size_t size = sizeof(ZygoteRequest) + strlen(l->path) + 3;
+    if (l->infile != NULL) size += strlen(l->infile);
+    if (l->outfile != NULL) size += strlen(l->outfile);
+    for (; l->argv[argc] != NULL; argc++) size += strlen(l->argv[argc]) + 1;
+    for (; env_vec[envc] != NULL; envc++) size += strlen(env_vec[envc]) + 1;
+    if (size > ZYGOTE_MSG) return launch_spawn(l);
+
+    char* msg = arena_alloc(&cmd_arena, size);
+    ZygoteRequest* req = (ZygoteRequest*)msg;
+    req->pgid = l->pgid;
+    req->terminal = interactive && l->foreground && l->pgid == 0;
+    req->argc = argc;
+    req->envc = envc;
+    char* p = msg + sizeof(ZygoteRequest);
+    p = stpcpy(p, l->path) + 1;
+    p = stpcpy(p, l->infile ? l->infile : "") + 1;
+    p = stpcpy(p, l->outfile ? l->outfile : "") + 1;
+    for (int i = 0; i < argc; i++) p = stpcpy(p, l->argv[i]) + 1;
+    for (int i = 0; i < envc; i++) p = stpcpy(p, env_vec[i]) + 1;
+
+    int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    int fds[4] = { l->in_fd >= 0 ? l->in_fd : STDIN_FILENO,
+                   l->out_fd >= 0 ? l->out_fd : STDOUT_FILENO,
+                   l->err_fd >= 0 ? l->err_fd : STDERR_FILENO, cwd };
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = { msg, p - msg };
+    struct msghdr mh = { 0 };
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+    struct cmsghdr* cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+    pid_t pid = -1;
+    ssize_t n;
+    while ((n = sendmsg(zygote_fd, &mh, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+    if (n >= 0) {
+        while ((n = recv(zygote_fd, &pid, sizeof(pid), 0)) < 0 && errno == EINTR);
+    }
+    close(cwd);
+    if (n != sizeof(pid)) {
+        // The server is gone; carry on without it
+        fprintf(stderr, "launcher: fork server exited, using spawn\n");
+        close(zygote_fd);
+        zygote_fd = -1;
+        launcher = LAUNCH_SPAWN;
+        return launch_spawn(l);
+    }
+    if (pid < 0) {
+        fprintf(stderr, "%s: %s\n", l->argv[0], strerror(-pid));
+        return -1;
+    }
+    setpgid(pid, l->pgid == 0 ? pid : l->pgid);
+    if (req->terminal) tcsetpgrp(STDIN_FILENO, pid);
+    return pid;
+}
+
+// The fork server's whole life: receive a request, clone a child that
+// belongs to the shell, answer with its pid. Exits when the shell does.
+int zygote_main(int sock) {
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+    char* msg = malloc(ZYGOTE_MSG);
+    for (;;) {
+        int fds[4];
+        char control[CMSG_SPACE(sizeof(fds))];
+        struct iovec iov = { msg, ZYGOTE_MSG - 1 };
+        struct msghdr mh = { 0 };
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+        mh.msg_control = control;
+        mh.msg_controllen = sizeof(control);
+        ssize_t n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        struct cmsghdr* cm = CMSG_FIRSTHDR(&mh);
+        if (cm == NULL || cm->cmsg_type != SCM_RIGHTS || (size_t)n < sizeof(ZygoteRequest)) {
+            pid_t err = -EINVAL;
+            send(sock, &err, sizeof(err), MSG_NOSIGNAL);
+            continue;
+        }
+        memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+        msg[n] = '\0';
+
+        pid_t pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, NULL, NULL, 0);
+        if (pid == 0) {
+            ZygoteRequest* req = (ZygoteRequest*)msg;
+            char* p = msg + sizeof(ZygoteRequest);
+            char* path = p;
+            char* infile = (p += strlen(p) + 1);
+            char* outfile = (p += strlen(p) + 1);
+            p += strlen(p) + 1;
+            char** argv = malloc(sizeof(char*) * (req->argc + 1));
+            char** envp = malloc(sizeof(char*) * (req->envc + 1));
+            for (int i = 0; i < req->argc; i++, p += strlen(p) + 1) argv[i] = p;
+            argv[req->argc] = NULL;
+            for (int i = 0; i < req->envc; i++, p += strlen(p) + 1) envp[i] = p;
+            envp[req->envc] = NULL;
+
+            for (int i = 0; i < 3; i++) dup2(fds[i], i);
+            if (fchdir(fds[3]) < 0) _exit(1);
+            setpgid(0, req->pgid);
+            if (req->terminal) tcsetpgrp(STDIN_FILENO, getpgrp());
+            signal(SIGINT, SIG_DFL);
+            signal(SIGQUIT, SIG_DFL);
+            signal(SIGTTOU, SIG_DFL);
+            if (infile[0] != '\0') {
+                int fd = open(infile, O_RDONLY);
+                if (fd < 0) {
+                    perror("Failed to open input file");
+                    _exit(1);
+                }
+                dup2(fd, STDIN_FILENO);
+                close(fd);
+            }
+            if (outfile[0] != '\0') {
+                int fd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (fd < 0) {
+                    perror("Failed to open output file");
+                    _exit(1);
+                }
+                dup2(fd, STDOUT_FILENO);
+                close(fd);
+            }
+            execve(path, argv, envp);
+            int err = errno;
+            perror("Command not found...");
+            _exit(err == ENOENT ? 127 : 1);
+        }
+        if (pid < 0) pid = -errno;
+        for (int i = 0; i < 4; i++) close(fds[i]);
+        send(sock, &pid, sizeof(pid), MSG_NOSIGNAL);
+    }
+}
+
+void close_cloexec_fds() {
+    DIR* dir = opendir("/proc/self/fd");
+    if (dir == NULL) return;
+    struct dirent* e;
+    while ((e = readdir(dir)) != NULL) {
+        int fd = atoi(e->d_name);
+        if (fd > 2 && fd != dirfd(dir) && (fcntl(fd, F_GETFD) & FD_CLOEXEC)) close(fd);
+    }
+    closedir(dir);
+}
+
+pid_t launch_fork(Launch* l) {
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork failed");
+        return -1;
+    }
+    if (pid == 0) {
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        signal(SIGTTOU, SIG_DFL);
+        setpgid(0, l->pgid);
+        if (interactive && l->foreground) tcsetpgrp(STDIN_FILENO, getpgrp());
+        if (l->in_fd >= 0) dup2(l->in_fd, STDIN_FILENO);
+        if (l->out_fd >= 0) dup2(l->out_fd, STDOUT_FILENO);
+        if (l->err_fd >= 0) dup2(l->err_fd, STDERR_FILENO);
+        if (l->infile != NULL) {
+            int fd = open(l->infile, O_RDONLY);
+            if (fd < 0) {
+                perror("Failed to open input file");
+                exit(1);
+            }
+            dup2(fd, STDIN_FILENO);
+            close(fd);
+        }
+        if (l->outfile != NULL) {
+            int fd = open(l->outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) {
+                perror("Failed to open output file");
+                exit(1);
+            }
+            dup2(fd, STDOUT_FILENO);
+            close(fd);
+        }
+        trace_on = 0;
+        if (is_builtin(l->argv[0])) {
+            // A builtin never execs, so close what exec would have (other
+            // pipe ends, pidfds) or readers of our pipes never see EOF.
+            // The shell's buffered input stays with the parent.
+            close_cloexec_fds();
+            job_epfd = -1;
+            stdin_reader.buf = NULL;
+            execute_builtin(l->argv);
+            exit(last_status);
+        }
+        execve(l->path, l->argv, env_vec);
+        int err = errno;
+        perror("Command not found...");
+        exit(err == ENOENT ? 127 : 1);
+    }
+    // Set the group from the parent too, so a later pipeline stage never
+    // tries to join a group that does not exist yet
+    setpgid(pid, l->pgid == 0 ? pid : l->pgid);
+    if (interactive && l->foreground && l->pgid == 0) tcsetpgrp(STDIN_FILENO, pid);
+    return pid;
+}
+
+// posix_spawn backend. glibc implements it with clone(CLONE_VM|CLONE_VFORK),
+// so no page tables are copied no matter how large the shell has grown.
+// Redirections, the process group and signal resets are all expressed as
+// file actions and attributes.
+pid_t launch_spawn(Launch* l) {
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawnattr_init(&attr);
+
+    if (l->in_fd >= 0) posix_spawn_file_actions_adddup2(&fa, l->in_fd, STDIN_FILENO);
+    if (l->out_fd >= 0) posix_spawn_file_actions_adddup2(&fa, l->out_fd, STDOUT_FILENO);
+    if (l->err_fd >= 0) posix_spawn_file_actions_adddup2(&fa, l->err_fd, STDERR_FILENO);
+    if (l->infile != NULL)
+        posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, l->infile, O_RDONLY, 0);
+    if (l->outfile != NULL)
+        posix_spawn_file_actions_addopen(&fa, STDOUT_FILENO, l->outfile,
+                                         O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#ifdef __GLIBC_PREREQ
+#if __GLIBC_PREREQ(2, 35)
+    if (interactive && l->foreground && l->pgid == 0)
+        posix_spawn_file_actions_addtcsetpgrp_np(&fa, STDIN_FILENO);
+#endif
+#endif
+
+    sigset_t none, defaults;
+    sigemptyset(&none);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGTTOU);
+    sigaddset(&defaults, SIGCHLD);
+    posix_spawnattr_setsigmask(&attr, &none);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setpgroup(&attr, l->pgid);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK |
+                                    POSIX_SPAWN_SETSIGDEF);
+
+    pid_t pid;
+    int err = posix_spawn(&pid, l->path, &fa, &attr, l->argv, env_vec);
+    if (err == ENOENT) {
+        // The cached binary went away; look it up once more
+        path_cache_forget(l->argv[0]);
+        l->path = lookup_command(l->argv[0]);
+        if (l->path != NULL) err = posix_spawn(&pid, l->path, &fa, &attr, l->argv, env_vec);
+    }
+    posix_spawn_file_actions_destroy(&fa);
+    posix_spawnattr_destroy(&attr);
+    if (err != 0) {
+        fprintf(stderr, "%s: %s\n", l->argv[0], strerror(err));
+        return -1;
+    }
+    if (interactive && l->foreground && l->pgid == 0) tcsetpgrp(STDIN_FILENO, pid);
+    return pid;
+}
+
+// Run an N-stage pipeline. All stages are started into one process group
+// before anything is waited on; `<` is honored on the first stage and `>` on
+// the last. Returns the pipefail-style status of the whole pipeline.
+int handle_pipe(Stage* stages, int n, int background, const char* text, const Placement* where) {
+    for (int i = 0; i < n; i++) {
+        const Builtin* b = find_builtin(stages[i].argv[0]);
+        if (b != NULL && !(b->flags & BUILTIN_PIPE)) {
+            fprintf(stderr, "%s: cannot be used in a pipeline\n", b->name);
+            last_status = 2;
+            return -1;
+        }
+    }
+
+    // Create all n-1 pipes up front. They are close-on-exec, so each child
+    // only keeps the two ends it dup2()s onto stdin/stdout.
+    int (*pipes)[2] = arena_alloc(&cmd_arena, sizeof(int[2]) * n);
+    for (int i = 0; i < n - 1; i++) {
+        if (pipe2(pipes[i], O_CLOEXEC) == -1) {
+            perror("pipe failed");
+            for (int j = 0; j < i; j++) {
+                close(pipes[j][0]);
+                close(pipes[j][1]);
+            }
+            return -1;
+        }
+    }
+
+    // set -o joblog: the last stage's stdout and every stage's stderr go
+    // to a pipe the shell drains
+    int log_fd = -1;
+    JobLog* log = background && joblog_on ? joblog_new(text, &log_fd) : NULL;
+
+    pid_t* pids = arena_alloc(&cmd_arena, sizeof(pid_t) * n);
+    pid_t pgid = 0;
+    int started = 0;
+    for (int i = 0; i < n; i++) {
+        Launch l = { stages[i].argv, stages[i].infile, stages[i].outfile, -1, -1, log_fd, pgid, !background };
+        l.stage = i;
+        if (i > 0) l.in_fd = pipes[i - 1][0];
+        l.out_fd = i < n - 1 ? pipes[i][1] : log_fd;
+        pid_t pid = launch_process(&l);
+        if (pid < 0) break;
+        if (where != NULL && placement_apply(pid, where) < 0) {
+            fprintf(stderr, "run: %d: %s\n", pid, strerror(errno));
+        }
+        if (pgid == 0) pgid = pid;
+        pids[i] = pid;
+        started++;
+    }
+
+    for (int i = 0; i < n - 1; i++) {
+        close(pipes[i][0]);
+        close(pipes[i][1]);
+    }
+    if (log != NULL) close(log_fd);
+
+    if (background) {
+        if (started > 0) {
+            last_background = pids[started - 1];
+            Job* job = add_job(pgid, pids, started, text);
+            if (where != NULL) job->place = *where;
+            if (log != NULL) joblog_attach(log, job->id);
+            out_printf("[%d] %d\n", job->id, pgid);
+        } else if (log != NULL) {
+            joblog_free(log);
+        }
+        last_status = started == n ? 0 : 1;
+        return 0;
+    }
+
+    // Collect every stage in whatever order they finish
+    int* statuses = arena_alloc(&cmd_arena, sizeof(int) * n);
+    for (int i = 0; i < n; i++) statuses[i] = 0;
+    int remaining = started;
+    int stopped = 0;
+    unsigned long long wait_start = trace_begin();
+    while (remaining > 0 && !stopped) {
+        int status;
+        struct rusage ru;
+        pid_t pid = wait4(-pgid, &status, WUNTRACED, &ru);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (WIFSTOPPED(status)) {
+            // Ctrl-Z stops the whole process group; one stop is enough
+            stopped = status;
+            continue;
+        }
+        add_child_usage(&ru);
+        for (int i = 0; i < started; i++) {
+            if (pids[i] == pid) {
+                statuses[i] = status;
+                pids[i] = 0;
+                remaining--;
+                trace_span("wait", stages[i].argv[0], wait_start, pid, i);
+                break;
+            }
+        }
+    }
+
+    if (interactive) tcsetpgrp(STDIN_FILENO, getpgrp());
+    if (stopped) {
+        // The job keeps only the stages that have not been reaped yet
+        int alive = 0;
+        for (int i = 0; i < started; i++) {
+            if (pids[i] != 0) pids[alive++] = pids[i];
+        }
+        job_stopped(pgid, pids, alive, text, stopped);
+        return last_status;
+    }
+
+    for (int i = 0; i < started; i++) {
+        if (WIFEXITED(statuses[i]) && WEXITSTATUS(statuses[i]) == 127)
+            path_cache_forget(stages[i].argv[0]);
+    }
+    if (started < n) statuses[started] = 1 << 8;
+    last_status = pipeline_status(statuses, started < n ? started + 1 : n);
+    return last_status;
+}
+
+// Exit status of a pipeline: that of the rightmost stage that failed, or 0
+int pipeline_status(int* statuses, int n) {
+    int result = 0;
+    for (int i = 0; i < n; i++) {
+        int code;
+        if (WIFEXITED(statuses[i])) code = WEXITSTATUS(statuses[i]);
+        else if (WIFSIGNALED(statuses[i])) code = 128 + WTERMSIG(statuses[i]);
+        else code = 1;
+        if (code != 0) result = code;
+    }
+    return result;
+}
+
+
+// Set up the job table's epoll set. Each background process gets a pidfd in
+// it, so finished processes are found without signals or scans. SIGCHLD is
+// left at its default; nothing reaps asynchronously behind execute()'s back.
+void jobs_init() {
+    job_epfd = epoll_create1(EPOLL_CLOEXEC);
+    // Thousands of background jobs need thousands of pidfds
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+void job_pids_insert(JobProc* proc) {
+    if ((job_pids_count + 1) * 2 > job_pids_cap) {
+        // Sized from the live process count, at most half full; rehash only
+        // what is still running
+        size_t oldcap = job_pids_cap;
+        JobProc** old = job_pids;
+        job_pids_cap = oldcap ? oldcap * 2 : 64;
+        while ((job_pids_count + 1) * 2 > job_pids_cap) job_pids_cap *= 2;
+        job_pids = calloc(job_pids_cap, sizeof(JobProc*));
+        for (size_t i = 0; i < oldcap; i++) {
+            if (old[i] == NULL) continue;
+            size_t j = (size_t)old[i]->pid & (job_pids_cap - 1);
+            while (job_pids[j] != NULL) j = (j + 1) & (job_pids_cap - 1);
+            job_pids[j] = old[i];
+        }
+        free(old);
+    }
+    size_t j = (size_t)proc->pid & (job_pids_cap - 1);
+    while (job_pids[j] != NULL) j = (j + 1) & (job_pids_cap - 1);
+    job_pids[j] = proc;
+    job_pids_count++;
+}
+
+JobProc* find_job_proc(pid_t pid) {
+    if (job_pids_cap == 0) return NULL;
+    for (size_t j = (size_t)pid & (job_pids_cap - 1); job_pids[j] != NULL;
+         j = (j + 1) & (job_pids_cap - 1)) {
+        if (job_pids[j]->pid == pid) return job_pids[j];
+    }
+    return NULL;
+}
+
+void job_pids_remove(pid_t pid) {
+    size_t mask = job_pids_cap - 1;
+    size_t i = (size_t)pid & mask;
+    while (job_pids[i] != NULL && job_pids[i]->pid != pid) i = (i + 1) & mask;
+    if (job_pids[i] == NULL) return;
+    job_pids[i] = NULL;
+    job_pids_count--;
+    for (size_t j = (i + 1) & mask; job_pids[j] != NULL; j = (j + 1) & mask) {
+        size_t home = (size_t)job_pids[j]->pid & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            job_pids[i] = job_pids[j];
+            job_pids[j] = NULL;
+            i = j;
+        }
+    }
+}
+
+// Register a background job made of the given processes
+Job* add_job(pid_t pgid, pid_t* pids, int n, const char* command) {
+    if (job_max == job_slots) {
+        job_slots = job_slots ? job_slots * 2 : 16;
+        jobs = realloc(jobs, job_slots * sizeof(Job*));
+    }
+    Job* job = calloc(1, sizeof(Job));
+    job->id = ++job_max;
+    job->pgid = pgid;
+    job->procs = calloc(n, sizeof(JobProc));
+    job->nprocs = n;
+    job->alive = n;
+    job->state = JOB_RUNNING;
+    job->command = strdup(command);
+    job->place.policy = -1;
+    jobs[job->id - 1] = job;
+    job_count++;
+
+    for (int i = 0; i < n; i++) {
+        JobProc* proc = &job->procs[i];
+        proc->pid = pids[i];
+        proc->job = job;
+        proc->pidfd = syscall(SYS_pidfd_open, pids[i], 0);
+        if (proc->pidfd >= 0) {
+            fcntl(proc->pidfd, F_SETFD, FD_CLOEXEC);
+            struct epoll_event ev = { .events = EPOLLIN, .data.ptr = proc };
+            epoll_ctl(job_epfd, EPOLL_CTL_ADD, proc->pidfd, &ev);
+        } else {
+            jobs_without_pidfd++;
+        }
+        job_pids_insert(proc);
+    }
+    return job;
+}
+
+// A foreground job was stopped: keep it in the job table as stopped. Its
+// processes are still ours to reap, through the same pidfds as any job.
+void job_stopped(pid_t pgid, pid_t* pids, int n, const char* command, int status) {
+    Job* job = add_job(pgid, pids, n, command);
+    job->state = JOB_STOPPED;
+    last_status = 128 + WSTOPSIG(status);
+    out_printf("\n[%d]  Stopped\t\t%s\n", job->id, command);
+}
+
+// Record the exit of one job process; the job is done when its last one is
+void job_proc_exited(JobProc* proc, int status) {
+    Job* job = proc->job;
+    proc->status = status;
+    proc->done = 1;
+    if (proc->pidfd >= 0) close(proc->pidfd);  // also drops it from job_epfd
+    else jobs_without_pidfd--;
+    proc->pidfd = -1;
+    job_pids_remove(proc->pid);
+
+    if (--job->alive > 0) return;
+    int* statuses = malloc(job->nprocs * sizeof(int));
+    for (int i = 0; i < job->nprocs; i++) statuses[i] = job->procs[i].status;
+    job->status = pipeline_status(statuses, job->nprocs);
+    free(statuses);
+    job->state = JOB_DONE;
+    last_status = job->status;
+
+    if (finished_count == finished_cap) {
+        finished_cap = finished_cap ? finished_cap * 2 : 16;
+        finished = realloc(finished, finished_cap * sizeof(Job*));
+    }
+    finished[finished_count++] = job;
+}
+
+// Reap whatever background processes have exited, waiting up to timeout ms
+// (-1 for ever) for the first one. Only ready pidfds are visited.
+void jobs_poll(int timeout) {
+    if (job_count == 0 && joblogs_open == 0) return;
+    struct epoll_event events[64];
+    int n;
+    do {
+        while ((n = epoll_wait(job_epfd, events, 64, timeout)) < 0 && errno == EINTR);
+        for (int i = 0; i < n; i++) {
+            JobProc* proc = events[i].data.ptr;
+            if (proc == (void*)&joblog_epfd) {
+                joblogs_poll();
+                continue;
+            }
+            if (proc == NULL) {
+                job_timer_fired = 1;
+                continue;
+            }
+            int status;
+            if (waitpid(proc->pid, &status, WNOHANG) == proc->pid) job_proc_exited(proc, status);
+        }
+        timeout = 0;
+    } while (n == 64);
+    // Processes we could not get a pidfd for are picked up the old way
+    if (jobs_without_pidfd > 0) {
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            JobProc* proc = find_job_proc(pid);
+            if (proc != NULL) job_proc_exited(proc, status);
+        }
+    }
+}
+
+// Print "[n] Done" for jobs that finished since the last prompt and forget them
+void jobs_notify() {
+    for (int i = 0; i < finished_count; i++) {
+        Job* job = finished[i];
+        if (job->status == 0) out_printf("[%d]  Done\t\t%s\n", job->id, job->command);
+        else out_printf("[%d]  Exit %d\t\t%s\n", job->id, job->status, job->command);
+        remove_job(job);
+    }
+    finished_count = 0;
+}
+
+// Block until fd is readable, reaping background jobs as they finish and
+// draining their captured output
+void wait_for_input(int fd) {
+    while (job_count > 0 || joblogs_open > 0) {
+        struct pollfd fds[2] = { { fd, POLLIN, 0 }, { job_epfd, POLLIN, 0 } };
+        int timeout = jobs_without_pidfd > 0 ? 100 : -1;
+        if (poll(fds, 2, timeout) < 0 && errno != EINTR) return;
+        jobs_poll(0);
+        if (fds[0].revents != 0) return;
+    }
+}
+
+// Start capturing a background job's output: returns the log and, in
+// write_fd, the pipe end its processes get as stdout and stderr. NULL if
+// the pipe cannot be made, and the job just writes to the terminal.
+JobLog* joblog_new(const char* command, int* write_fd) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) return NULL;
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    // A larger pipe rides out the time spent on a foreground command, when
+    // nothing drains it; the kernel caps this at fs.pipe-max-size
+    fcntl(fds[0], F_SETPIPE_SZ, joblog_size < JOBLOG_SIZE ? (int)joblog_size : JOBLOG_SIZE);
+    JobLog* log = calloc(1, sizeof(JobLog));
+    log->command = strdup(command);
+    log->fd = fds[0];
+    log->cap = joblog_size;
+    log->ring = malloc(log->cap);
+    log->spill_fd = -1;
+    joblogs_open++;
+    *write_fd = fds[1];
+    return log;
+}
+
+// File a log under its job's number, replacing what an earlier job with
+// that number left, and start draining it from the event loop
+void joblog_attach(JobLog* log, int id) {
+    if (joblog_epfd < 0) {
+        joblog_epfd = epoll_create1(EPOLL_CLOEXEC);
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &joblog_epfd };
+        epoll_ctl(job_epfd, EPOLL_CTL_ADD, joblog_epfd, &ev);
+    }
+    if (id > job_log_slots) {
+        int slots = job_log_slots ? job_log_slots : 16;
+        while (slots < id) slots *= 2;
+        job_logs = realloc(job_logs, slots * sizeof(JobLog*));
+        memset(job_logs + job_log_slots, 0, (slots - job_log_slots) * sizeof(JobLog*));
+        job_log_slots = slots;
+    }
+    if (job_logs[id - 1] != NULL) joblog_free(job_logs[id - 1]);
+    job_logs[id - 1] = log;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = log };
+    epoll_ctl(joblog_epfd, EPOLL_CTL_ADD, log->fd, &ev);
+}
+
+// The ring bytes for stream offsets [from, to), as at most two pieces
+int joblog_pieces(JobLog* log, size_t from, size_t to, struct iovec iov[2]) {
+    if (from >= to) return 0;
+    size_t pos = from % log->cap;
+    size_t first = to - from < log->cap - pos ? to - from : log->cap - pos;
+    iov[0].iov_base = log->ring + pos;
+    iov[0].iov_len = first;
+    iov[1].iov_base = log->ring;
+    iov[1].iov_len = to - from - first;
+    return iov[1].iov_len > 0 ? 2 : 1;
+}
+
+// Move the ring's bytes up to stream offset upto into the spill file
+void joblog_spill(JobLog* log, size_t upto) {
+    if (upto <= log->spilled) return;
+    if (log->spill_fd < 0) {
+        const char* dir = get_variable_value("TMPDIR");
+        if (dir == NULL || dir[0] == '\0') dir = "/tmp";
+        log->spill_fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+        if (log->spill_fd < 0) {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/myshell-joblog-XXXXXX", dir);
+            log->spill_fd = mkostemp(path, O_CLOEXEC);
+            if (log->spill_fd >= 0) unlink(path);
+        }
+    }
+    struct iovec iov[2];
+    int pieces = joblog_pieces(log, log->spilled, upto, iov);
+    size_t want = upto - log->spilled;
+    ssize_t n = log->spill_fd >= 0 ? writev(log->spill_fd, iov, pieces) : -1;
+    if (n < (ssize_t)want) log->lost += want - (n > 0 ? n : 0);
+    log->spilled = upto;
+}
+
+// Read what the job has written, straight into the ring, until the pipe
+// is empty or the given number of reads were made
+void joblog_drain(JobLog* log, int reads) {
+    for (int i = 0; log->fd >= 0 && i < reads; i++) {
+        size_t pos = log->total % log->cap;
+        size_t room = log->cap - pos;
+        if (room > READ_CHUNK) room = READ_CHUNK;
+        // Whatever this read may overwrite goes to the spill file first
+        if (log->total + room > log->cap) joblog_spill(log, log->total + room - log->cap);
+        ssize_t n = read(log->fd, log->ring + pos, room);
+        if (n > 0) {
+            log->total += n;
+            continue;
+        }
+        if (n < 0 && (errno == EINTR || errno == EAGAIN)) return;
+        // Every writer is gone (or the pipe broke): nothing more will come
+        close(log->fd);
+        log->fd = -1;
+        joblogs_open--;
+    }
+}
+
+// Drain every log pipe that has data; called when joblog_epfd is ready
+void joblogs_poll() {
+    struct epoll_event events[64];
+    int n;
+    do {
+        while ((n = epoll_wait(joblog_epfd, events, 64, 0)) < 0 && errno == EINTR);
+        for (int i = 0; i < n; i++) joblog_drain(events[i].data.ptr, JOBLOG_READS);
+    } while (n == 64);
+}
+
+// Write the whole log to our stdout: the spill file, then the ring
+void joblog_print(JobLog* log) {
+    if (log->spill_fd >= 0) {
+        int fd = log->spill_fd;
+        if (job_epfd < 0) {
+            // A pipeline stage, whose copy of the shell's descriptors was
+            // closed at fork; the shell still has the file open
+            char path[64];
+            snprintf(path, sizeof(path), "/proc/%d/fd/%d", getppid(), log->spill_fd);
+            fd = open(path, O_RDONLY | O_CLOEXEC);
+        }
+        char* buf = arena_alloc(&cmd_arena, READ_CHUNK);
+        off_t off = 0;
+        ssize_t n;
+        while (fd >= 0 && (n = pread(fd, buf, READ_CHUNK, off)) > 0) {
+            out_write(buf, n);
+            off += n;
+        }
+        if (fd != log->spill_fd && fd >= 0) close(fd);
+    }
+    struct iovec iov[2];
+    int pieces = joblog_pieces(log, log->spilled, log->total, iov);
+    for (int i = 0; i < pieces; i++) out_write(iov[i].iov_base, iov[i].iov_len);
+}
+
+void joblog_free(JobLog* log) {
+    if (log->fd >= 0) {
+        close(log->fd);
+        joblogs_open--;
+    }
+    if (log->spill_fd >= 0) close(log->spill_fd);
+    free(log->ring);
+    free(log->command);
+    free(log);
+}
+
+// With verbose, also each process and the job's placement
+void list_jobs(int verbose) {
+    for (int id = 1; id <= job_max; id++) {
+        Job* job = jobs[id - 1];
+        if (job == NULL) continue;
+        out_printf("[%d]  %-8s %d\t%s\n", id, job->state == JOB_DONE ? "Done" : job->state == JOB_STOPPED ? "Stopped" : "Running",
+               job->pgid, job->command);
+        if (!verbose) continue;
+        for (int i = 0; i < job->nprocs; i++) {
+            out_printf("      %d %s\n", job->procs[i].pid, job->procs[i].done ? "done"
+                       : job->state == JOB_STOPPED ? "stopped" : "running");
+        }
+        char place[512];
+        placement_format(&job->place, place, sizeof(place));
+        out_printf("      placement: %s\n", place);
+    }
+}
+
+// Parse a CPU list such as 0-3,8,10-11
+int parse_cpus(const char* list, cpu_set_t* set) {
+    CPU_ZERO(set);
+    const char* p = list;
+    do {
+        char* end;
+        long lo = strtol(p, &end, 10), hi = lo;
+        if (end == p || lo < 0) return -1;
+        if (*end == '-') {
+            p = end + 1;
+            hi = strtol(p, &end, 10);
+            if (end == p || hi < lo) return -1;
+        }
+        if (hi >= CPU_SETSIZE) return -1;
+        for (long c = lo; c <= hi; c++) CPU_SET(c, set);
+        p = end;
+    } while (*p++ == ',');
+    return p[-1] == '\0' ? 0 : -1;
+}
+
+// Parse `run` options from argv[1] on: --cpus LIST, --nice N,
+// --sched other|batch|idle|fifo[:prio]|rr[:prio], --io rt|be[:level]|idle.
+// Returns the index of the first word after them, or -1 after an error.
+int placement_parse(char** argv, Placement* p, int quiet) {
+    memset(p, 0, sizeof(Placement));
+    p->policy = -1;
+    int i = 1;
+    for (; argv[i] != NULL && strncmp(argv[i], "--", 2) == 0; i += 2) {
+        const char* opt = argv[i] + 2;
+        const char* val = argv[i + 1];
+        int ok = val != NULL;
+        if (opt[0] == '\0') return i + 1;  // `--` ends the options
+        if (ok && strcmp(opt, "cpus") == 0) {
+            ok = parse_cpus(val, &p->cpus) == 0 && CPU_COUNT(&p->cpus) > 0;
+            p->has_cpus = 1;
+        } else if (ok && strcmp(opt, "nice") == 0) {
+            char* end;
+            p->nice = strtol(val, &end, 10);
+            ok = *end == '\0' && end != val && p->nice >= -20 && p->nice <= 19;
+            p->has_nice = 1;
+        } else if (ok && strcmp(opt, "sched") == 0) {
+            const char* colon = strchr(val, ':');
+            size_t len = colon ? (size_t)(colon - val) : strlen(val);
+            static const struct { const char* name; int policy; } policies[] = {
+                { "other", SCHED_OTHER }, { "batch", SCHED_BATCH }, { "idle", SCHED_IDLE },
+                { "fifo", SCHED_FIFO }, { "rr", SCHED_RR },
+            };
+            for (size_t k = 0; k < sizeof(policies) / sizeof(policies[0]); k++) {
+                if (strlen(policies[k].name) == len && strncmp(val, policies[k].name, len) == 0) {
+                    p->policy = policies[k].policy;
+                }
+            }
+            int realtime = p->policy == SCHED_FIFO || p->policy == SCHED_RR;
+            p->priority = colon ? atoi(colon + 1) : realtime;
+            ok = p->policy >= 0 && (realtime ? p->priority >= 1 && p->priority <= 99 : colon == NULL);
+        } else if (ok && strcmp(opt, "io") == 0) {
+            const char* colon = strchr(val, ':');
+            size_t len = colon ? (size_t)(colon - val) : strlen(val);
+            if (len == 2 && strncmp(val, "rt", 2) == 0) p->ioclass = 1;
+            if (len == 2 && strncmp(val, "be", 2) == 0) p->ioclass = 2;
+            if (len == 4 && strncmp(val, "idle", 4) == 0) p->ioclass = 3;
+            p->iolevel = colon ? atoi(colon + 1) : 4;
+            ok = p->ioclass != 0 && p->iolevel >= 0 && p->iolevel <= 7 && (p->ioclass != 3 || colon == NULL);
+        } else {
+            if (!quiet) fprintf(stderr, "run: unknown option %s\n", argv[i]);
+            return -1;
+        }
+        if (!ok) {
+            if (!quiet) fprintf(stderr, "run: bad value for %s: %s\n", argv[i], val ? val : "(none)");
+            return -1;
+        }
+    }
+    return i;
+}
+
+// Set one thread's scheduling; fields the placement leaves alone are read
+// back first so sched_setattr keeps them
+int placement_sched(pid_t tid, const Placement* p) {
+    SchedAttr attr;
+    memset(&attr, 0, sizeof(attr));
+    if (syscall(SYS_sched_getattr, tid, &attr, sizeof(attr), 0) < 0) return -1;
+    attr.size = sizeof(attr);
+    attr.sched_flags = 0;
+    if (p->policy >= 0) {
+        attr.sched_policy = p->policy;
+        attr.sched_priority = p->policy == SCHED_FIFO || p->policy == SCHED_RR ? p->priority : 0;
+    }
+    if (p->has_nice) attr.sched_nice = p->nice;
+    return syscall(SYS_sched_setattr, tid, &attr, 0);
+}
+
+// Apply a placement to every thread of a process. Affinity and scheduling
+// are per thread, so a running job that has started threads needs each of
+// them; a process that just started has one. Returns -1 with errno set if
+// any call failed.
+int placement_apply(pid_t pid, const Placement* p) {
+    pid_t tids[256];
+    int n = 0;
+    char dir[64];
+    snprintf(dir, sizeof(dir), "/proc/%d/task", pid);
+    DIR* d = opendir(dir);
+    struct dirent* e;
+    while (d != NULL && n < 256 && (e = readdir(d)) != NULL) {
+        if (e->d_name[0] != '.') tids[n++] = atoi(e->d_name);
+    }
+    if (d != NULL) closedir(d);
+    if (n == 0) tids[n++] = pid;
+
+    // The I/O class covers all threads. It goes first and the scheduling
+    // policy last: a realtime policy can preempt us before we finish.
+    int result = 0, err = 0;
+    if (p->ioclass != 0 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, pid,
+                                   p->ioclass << IOPRIO_CLASS_SHIFT | p->iolevel) < 0) {
+        result = -1;
+        err = errno;
+    }
+    for (int i = 0; i < n; i++) {
+        if (p->has_cpus && sched_setaffinity(tids[i], sizeof(cpu_set_t), &p->cpus) < 0) {
+            result = -1;
+            err = errno;
+        }
+        if ((p->policy >= 0 || p->has_nice) && placement_sched(tids[i], p) < 0) {
+            result = -1;
+            err = errno;
+        }
+    }
+    errno = err;
+    return result;
+}
+
+// Fields set in src override those in dst
+void placement_merge(Placement* dst, const Placement* src) {
+    if (src->has_cpus) {
+        dst->has_cpus = 1;
+        dst->cpus = src->cpus;
+    }
+    if (src->policy >= 0) {
+        dst->policy = src->policy;
+        dst->priority = src->priority;
+    }
+    if (src->has_nice) {
+        dst->has_nice = 1;
+        dst->nice = src->nice;
+    }
+    if (src->ioclass != 0) {
+        dst->ioclass = src->ioclass;
+        dst->iolevel = src->iolevel;
+    }
+}
+
+// "cpus 4-7 sched batch nice 10 io be:2", or "inherited"
+void placement_format(const Placement* p, char* buf, size_t size) {
+    size_t len = 0;
+    buf[0] = '\0';
+    if (p->has_cpus) {
+        len += snprintf(buf + len, size - len, "cpus ");
+        for (int c = 0; c < CPU_SETSIZE && len < size; c++) {
+            if (!CPU_ISSET(c, &p->cpus)) continue;
+            int last = c;
+            while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &p->cpus)) last++;
+            if (last > c) len += snprintf(buf + len, size - len, "%d-%d,", c, last);
+            else len += snprintf(buf + len, size - len, "%d,", c);
+            c = last;
+        }
+        if (len < size) buf[len - 1] = ' ';
+    }
+    static const char* policies[] = { "other", "fifo", "rr", "batch", "", "idle" };
+    if (p->policy >= 0 && len < size) {
+        len += snprintf(buf + len, size - len, "sched %s", policies[p->policy]);
+        if (p->policy == SCHED_FIFO || p->policy == SCHED_RR) {
+            len += snprintf(buf + len, size - len, ":%d", p->priority);
+        }
+        if (len < size) len += snprintf(buf + len, size - len, " ");
+    }
+    if (p->has_nice && len < size) len += snprintf(buf + len, size - len, "nice %d ", p->nice);
+    static const char* classes[] = { "", "rt", "be", "idle" };
+    if (p->ioclass != 0 && len < size) {
+        len += snprintf(buf + len, size - len, "io %s", classes[p->ioclass]);
+        if (p->ioclass != 3 && len < size) len += snprintf(buf + len, size - len, ":%d", p->iolevel);
+        if (len < size) len += snprintf(buf + len, size - len, " ");
+    }
+    if (len == 0) snprintf(buf, size, "inherited");
+    else if (len <= size) buf[len - 1] = '\0';
+}
+
+// Is argv a lone %n or the PID of a job, rather than a command to start?
+int run_targets_job(char** argv) {
+    if (argv[0] == NULL || argv[1] != NULL) return 0;
+    if (argv[0][0] == '%') return 1;
+    return strspn(argv[0], "0123456789") == strlen(argv[0]) && find_job(argv[0]) != NULL;
+}
+
+// Resolve %n, or a plain PID, to its job
+Job* find_job(const char* spec) {
+    if (spec[0] == '%') {
+        int id = atoi(spec + 1);
+        return id >= 1 && id <= job_max ? jobs[id - 1] : NULL;
+    }
+    JobProc* proc = find_job_proc(atoi(spec));
+    return proc != NULL ? proc->job : NULL;
+}
+
+// Drop a finished job without the "[n] Done" notice: it has been waited for
+void job_forget(Job* job) {
+    for (int i = 0; i < finished_count; i++) {
+        if (finished[i] == job) {
+            memmove(finished + i, finished + i + 1, (finished_count - i - 1) * sizeof(Job*));
+            finished_count--;
+            remove_job(job);
+            return;
+        }
+    }
+}
+
+// A job process by PID, including ones that have exited but whose job is
+// still in the table
+JobProc* job_proc_any(pid_t pid) {
+    JobProc* proc = find_job_proc(pid);
+    for (int id = 1; proc == NULL && id <= job_max; id++) {
+        Job* job = jobs[id - 1];
+        for (int i = 0; job != NULL && i < job->nprocs; i++) {
+            if (job->procs[i].pid == pid) proc = &job->procs[i];
+        }
+    }
+    return proc;
+}
+
+void remove_job(Job* job) {
+    for (int i = 0; i < job->nprocs; i++) {
+        if (!job->procs[i].done) {
+            if (job->procs[i].pidfd >= 0) close(job->procs[i].pidfd);
+            else jobs_without_pidfd--;
+            job_pids_remove(job->procs[i].pid);
+        }
+    }
+    jobs[job->id - 1] = NULL;
+    job_count--;
+    while (job_max > 0 && jobs[job_max - 1] == NULL) job_max--;
+    free(job->procs);
+    free(job->command);
+    free(job);
+}
+
+
+// Look a variable up by name and precomputed hash
+Variable* find_variable(const char* name, unsigned long h) {
+    if (var_slots_cap == 0) return NULL;
+    size_t mask = var_slots_cap - 1;
+    for (size_t i = h & mask; var_slots[i] != 0; i = (i + 1) & mask) {
+        Variable* v = &variables[var_slots[i] - 1];
+        if (v->hash == h && strcmp(v->name, name) == 0) return v;
+    }
+    return NULL;
+}
+
+// Function to get the value of a user-defined variable
+// The pointer stays valid until the variable is next set
+char* get_variable_value(const char* name) {
+    if (name[0] == '?' && name[1] == '\0') {
+        static char status[16];
+        snprintf(status, sizeof(status), "%d", last_status);
+        return status;
+    }
+    Variable* v = find_variable(name, hash_string(name));
+    return v != NULL && v->value != NULL ? v->value->data : NULL;
+}
+
+// The table entry for name, added (unset and not exported) if it is new
+Variable* variable_entry(const char* name, unsigned long h) {
+    Variable* v = find_variable(name, h);
+    if (v == NULL) {
+        if (variable_count == variable_cap) {
+            variable_cap = variable_cap ? variable_cap * 2 : 64;
+            variables = realloc(variables, variable_cap * sizeof(Variable));
+        }
+        // Keep the table at most half full so probe runs stay short
+        if ((variable_count + 1) * 2 > var_slots_cap) {
+            size_t newcap = var_slots_cap ? var_slots_cap * 2 : 128;
+            free(var_slots);
+            var_slots = calloc(newcap, sizeof(size_t));
+            var_slots_cap = newcap;
+            for (size_t i = 0; i < variable_count; i++) {
+                size_t j = variables[i].hash & (newcap - 1);
+                while (var_slots[j] != 0) j = (j + 1) & (newcap - 1);
+                var_slots[j] = i + 1;
+            }
+        }
+        v = &variables[variable_count];
+        v->name = strdup(name);
+        v->hash = h;
+        v->value = NULL;
+        v->exported = 0;
+        size_t j = h & (var_slots_cap - 1);
+        while (var_slots[j] != 0) j = (j + 1) & (var_slots_cap - 1);
+        var_slots[j] = ++variable_count;
+    }
+    return v;
+}
+
+// Store a value, overwriting in place when it fits
+void variable_assign(Variable* v, const char* value, size_t len) {
+    if (v->value == NULL || v->value->cap < len) {
+        free(v->value);
+        v->value = malloc(sizeof(VarValue) + len + 1);
+        v->value->cap = len;
+    }
+    memcpy(v->value->data, value, len + 1);
+    v->value->len = len;
+    if (v->exported) env_dirty = 1;
+}
+
+// Function to set or update the value of a user-defined variable
+void set_variable(const char* name, const char* value) {
+    Variable* v = variable_entry(name, hash_string(name));
+    if (strcmp(name, "HISTSIZE") == 0) history_resize(strtoul(value, NULL, 10));
+    variable_assign(v, value, strlen(value));
+}
+
+// Take the environment we were started with into the variable table, all
+// exported. From here on the table is the only copy that is changed.
+void env_import() {
+    for (char** e = environ; *e != NULL; e++) {
+        char* eq = strchr(*e, '=');
+        if (eq == NULL || eq == *e) continue;
+        char* name = strndup(*e, eq - *e);
+        Variable* v = variable_entry(name, hash_string(name));
+        free(name);
+        v->exported = 1;
+        variable_assign(v, eq + 1, strlen(eq + 1));
+    }
+}
+
+// The envp for exec: one pointer array into one block of NAME=value
+// strings, both reused across builds. It is only rebuilt after an exported
+// variable changed, so a run of commands pays for it once and each exec
+// costs no allocation or copying. environ points at it too, so getenv()
+// in the shell agrees with what children get.
+char** env_build() {
+    if (!env_dirty) return env_vec;
+    size_t count = 0, size = 0;
+    for (size_t i = 0; i < variable_count; i++) {
+        Variable* v = &variables[i];
+        if (!v->exported || v->value == NULL) continue;
+        count++;
+        size += strlen(v->name) + v->value->len + 2;
+    }
+    if (count + 1 > env_vec_cap) {
+        env_vec_cap = (count + 1) * 2;
+        env_vec = realloc(env_vec, env_vec_cap * sizeof(char*));
+    }
+    if (size > env_block_cap) {
+        env_block_cap = size * 2;
+        env_block = realloc(env_block, env_block_cap);
+    }
+    char* p = env_block;
+    size_t n = 0;
+    for (size_t i = 0; i < variable_count; i++) {
+        Variable* v = &variables[i];
+        if (!v->exported || v->value == NULL) continue;
+        env_vec[n++] = p;
+        p = stpcpy(p, v->name);
+        *p++ = '=';
+        memcpy(p, v->value->data, v->value->len + 1);
+        p += v->value->len + 1;
+    }
+    env_vec[n] = NULL;
+    environ = env_vec;
+    env_dirty = 0;
+    return env_vec;
+}
+
+// A line is an assignment when it starts with NAME= and NAME is an identifier
+int is_assignment(const char* cmdline) {
+    if (!(isalpha((unsigned char)cmdline[0]) || cmdline[0] == '_')) return 0;
+    const char* p = cmdline + 1;
+    while (isalnum((unsigned char)*p) || *p == '_') p++;
+    return *p == '=';
+}
+
+// Append n bytes to the arena string being built by expand_word()
+void expand_append(char** dst, size_t* len, size_t* cap, const char* data, size_t n) {
+    if (*len + n + 1 > *cap) {
+        size_t grown = (*cap + n) * 2;
+        char* bigger = arena_alloc(&cmd_arena, grown);
+        memcpy(bigger, *dst, *len);
+        *dst = bigger;
+        *cap = grown;
+    }
+    memcpy(*dst + *len, data, n);
+    *len += n;
+}
+
+// Append the value of the $reference at *pp to the arena string being built,
+// advancing *pp past it. A `$` that starts no reference is kept literally.
+void expand_reference(const char** pp, char** dst, size_t* len, size_t* cap) {
+    const char* p = *pp + 1;
+    char name[16];
+    const char* value = NULL;
+    const char* start = p;
+    size_t n = 0;
+    int braced = 0;
+    if (*p == '{') {
+        braced = 1;
+        start = ++p;
+        while (*p != '\0' && *p != '}') p++;
+        n = p - start;
+        if (*p == '}') p++;
+    } else if (*p == '?' || *p == '#' || *p == '$' || *p == '!' || isdigit((unsigned char)*p)) {
+        n = 1;
+        p++;
+    } else {
+        while (isalnum((unsigned char)*p) || *p == '_') p++;
+        n = p - start;
+    }
+    if (n == 0 && !braced) {
+        value = "$";
+    } else {
+        char* key = arena_strndup(&cmd_arena, start, n);
+        if (strcmp(key, "$") == 0) {
+            snprintf(name, sizeof(name), "%d", (int)getpid());
+            value = name;
+        } else if (strcmp(key, "!") == 0) {
+            snprintf(name, sizeof(name), "%d", (int)last_background);
+            value = last_background > 0 ? name : NULL;
+        } else {
+            value = get_variable_value(key);
+        }
+    }
+    if (value != NULL) expand_append(dst, len, cap, value, strlen(value));
+    *pp = p;
+}
+
+// Append n bytes, putting a backslash before those in escape (if not NULL):
+// in a glob pattern, quoted *, ? and [ must only match themselves
+void expand_literal(char** dst, size_t* len, size_t* cap, const char* data, size_t n, const char* escape) {
+    if (escape == NULL) {
+        expand_append(dst, len, cap, data, n);
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (strchr(escape, data[i]) != NULL && data[i] != '\0') expand_append(dst, len, cap, "\\", 1);
+        expand_append(dst, len, cap, data + i, 1);
+    }
+}
+
+// Expand $name, ${name}, $?, $#, $$, $0-$9, $(command) and `command` in one
+// word and remove its quotes: '...' is literal, "..." still expands $ and
+// substitutions, and a backslash takes the next character literally (in
+// double quotes only before $ ` " \). Unset names expand to nothing. Words
+// without any of that are returned as they are, and a word that is a single
+// substitution is the captured output itself, with no copy. With pattern,
+// the result is for glob_expand(): quoted glob characters and every
+// backslash get a backslash of their own.
+char* expand_text(const char* word, int pattern) {
+    const char* first = strpbrk(word, "$`'\"\\");
+    if (first == NULL) return (char*)word;
+    int subst = first[0] == '`' || (first[0] == '$' && first[1] == '(');
+    if (first == word && subst && *skip_substitution(word) == '\0') {
+        const char* end = skip_substitution(word);
+        size_t skip = word[0] == '`' ? 1 : 2;
+        size_t inner = end - word - skip - (end[-1] == (word[0] == '`' ? '`' : ')'));
+        size_t n;
+        char* output = capture_command(word + skip, inner, &n);
+        if (!pattern || memchr(output, '\\', n) == NULL) return output;
+        size_t len = 0, cap = n * 2 + 16;
+        char* dst = arena_alloc(&cmd_arena, cap);
+        expand_literal(&dst, &len, &cap, output, n, "\\");
+        dst[len] = '\0';
+        return dst;
+    }
+
+    const char* quoted = pattern ? "*?[\\" : NULL;    // literal text
+    const char* unquoted = pattern ? "\\" : NULL;     // what $ expansions produce
+    size_t cap = strlen(word) * 2 + 16;
+    size_t len = first - word;
+    char* dst = arena_alloc(&cmd_arena, cap);
+    memcpy(dst, word, len);
+    const char* p = first;
+    int dquote = 0;
+    while (*p != '\0') {
+        if (*p == '`' || (p[0] == '$' && p[1] == '(')) {
+            const char* end = skip_substitution(p);
+            size_t skip = *p == '`' ? 1 : 2;
+            size_t inner = end - p - skip - (end[-1] == (*p == '`' ? '`' : ')'));
+            size_t n;
+            char* output = capture_command(p + skip, inner, &n);
+            expand_literal(&dst, &len, &cap, output, n, dquote ? quoted : unquoted);
+            p = end;
+            continue;
+        }
+        if (*p == '$') {
+            size_t before = len;
+            expand_reference(&p, &dst, &len, &cap);
+            if (pattern) {
+                // Put the value back with its escapes
+                char* value = arena_strndup(&cmd_arena, dst + before, len - before);
+                len = before;
+                expand_literal(&dst, &len, &cap, value, strlen(value), dquote ? quoted : unquoted);
+            }
+            continue;
+        }
+        if (*p == '"') {
+            dquote = !dquote;
+            p++;
+            continue;
+        }
+        if (*p == '\'' && !dquote) {
+            const char* close = strchr(p + 1, '\'');
+            size_t n = close != NULL ? (size_t)(close - p - 1) : strlen(p + 1);
+            expand_literal(&dst, &len, &cap, p + 1, n, quoted);
+            p += n + 1 + (close != NULL);
+            continue;
+        }
+        if (*p == '\\' && p[1] != '\0' && (!dquote || strchr("$`\"\\", p[1]) != NULL)) {
+            expand_literal(&dst, &len, &cap, p + 1, 1, quoted);
+            p += 2;
+            continue;
+        }
+        expand_literal(&dst, &len, &cap, p, 1, dquote || *p == '\\' ? quoted : NULL);
+        p++;
+    }
+    dst[len] = '\0';
+    return dst;
+}
+
+char* expand_word(const char* word) {
+    return expand_text(word, 0);
+}
+
+// A word expanded for globbing; see glob_unescape() for the plain word
+char* expand_pattern(const char* word) {
+    return expand_text(word, 1);
+}
+
+// Skip the $(...) or `...` starting at p. Returns the character after its
+// end, or the end of the string if it is never closed.
+const char* skip_substitution(const char* p) {
+    if (*p == '`') {
+        const char* end = strchr(p + 1, '`');
+        return end != NULL ? end + 1 : p + strlen(p);
+    }
+    int depth = 0;
+    for (p++; *p != '\0'; p++) {
+        if (*p == '`') {
+            p = skip_substitution(p) - 1;
+        } else if (*p == '(') {
+            depth++;
+        } else if (*p == ')' && --depth == 0) {
+            return p + 1;
+        }
+    }
+    return p;
+}
+
+// Map the output a child left in a memfd, from CAPTURE_HEADER on, as a chunk.
+// The header goes in the page before the output, so nothing is copied; one
+// extra zero byte past the end terminates the string.
+ArenaChunk* capture_map(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) return NULL;
+    size_t end = st.st_size > CAPTURE_HEADER ? st.st_size : CAPTURE_HEADER;
+    if (ftruncate(fd, end + 1) < 0) return NULL;
+    char* map = mmap(NULL, end + 1, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) return NULL;
+    ArenaChunk* c = (ArenaChunk*)(map + CAPTURE_HEADER - offsetof(ArenaChunk, data));
+    c->size = end + 1;
+    c->used = end - CAPTURE_HEADER;
+    c->mapped = 1;
+    return c;
+}
+
+// Run the text of a $(...) and return what it printed, minus trailing
+// newlines. A builtin that does not touch shell state runs right here with
+// the writer diverted into a buffer, so no process is created. Anything else
+// writes into a memfd that is mapped once it exits, so a gigabyte of output
+// is never copied through a pipe: a single external command is launched as
+// usual, while pipelines, assignments and cd run in a forked copy of the
+// shell so they cannot change ours. The result belongs to cmd_arena.
+char* capture_command(const char* text, size_t textlen, size_t* lenp) {
+    Command cmd;
+    parse_command(&cmd_arena, arena_strndup(&cmd_arena, text, textlen), &cmd);
+    ArenaChunk* buf = NULL;
+    Stage stage = { NULL, NULL, NULL };
+    const Builtin* b = NULL;
+    int simple = cmd.kind == CMD_PIPELINE && cmd.nstages == 1 && !cmd.background && cmd.next == NULL;
+    if (simple) {
+        stage.argv = expand_argv(cmd.stages[0].argv);
+        stage.infile = cmd.stages[0].infile ? expand_word(cmd.stages[0].infile) : NULL;
+        stage.outfile = cmd.stages[0].outfile ? expand_word(cmd.stages[0].outfile) : NULL;
+        b = find_builtin(stage.argv[0]);
+    }
+
+    if (cmd.kind == CMD_EMPTY && cmd.next == NULL) {
+        last_status = 0;
+    } else if (simple && b != NULL && !(b->flags & BUILTIN_PARENT) && !stage.infile && !stage.outfile) {
+        buf = chunk_new(ARENA_CHUNK);
+        out_flush();
+        ArenaChunk** outer = out.capture;
+        out.capture = &buf;
+        execute_builtin(stage.argv);
+        out_flush();
+        out.capture = outer;
+    } else {
+        // The child writes from CAPTURE_HEADER on, leaving room for the chunk
+        int fd = memfd_create("capture", MFD_CLOEXEC);
+        if (fd < 0 || lseek(fd, CAPTURE_HEADER, SEEK_SET) < 0) {
+            perror("memfd_create failed");
+            if (fd >= 0) close(fd);
+            last_status = 1;
+            if (lenp) *lenp = 0;
+            return "";
+        }
+        pid_t pid;
+        if (simple && b == NULL) {
+            Launch l = { stage.argv, stage.infile, stage.outfile, -1, fd, -1, 0, 1 };
+            pid = launch_process(&l);
+        } else {
+            out_flush();
+            pid = fork();
+            if (pid == 0) {
+                dup2(fd, STDOUT_FILENO);
+                trace_on = 0;
+                // As for a forked builtin: the parent's pipes, pidfds and
+                // job logs are not ours to read or hold open
+                close_cloexec_fds();
+                job_epfd = -1;
+                stdin_reader.buf = NULL;
+                run_command(&cmd);
+                out_flush();
+                _exit(last_status);
+            }
+        }
+        if (pid > 0) {
+            int status;
+            struct rusage ru;
+            // An external command gets the terminal and a group of its own,
+            // so Ctrl-Z stops just it; a forked shell stays in ours
+            int own_group = simple && b == NULL;
+            while (wait4(pid, &status, own_group ? WUNTRACED : 0, &ru) < 0 && errno == EINTR);
+            if (interactive) tcsetpgrp(STDIN_FILENO, getpgrp());
+            if (WIFSTOPPED(status)) {
+                // Kept as a stopped job; the substitution gets nothing
+                job_stopped(pid, &pid, 1, arena_strndup(&cmd_arena, text, textlen), status);
+            } else {
+                add_child_usage(&ru);
+                if (simple && WIFEXITED(status) && WEXITSTATUS(status) == 127) path_cache_forget(stage.argv[0]);
+                last_status = pipeline_status(&status, 1);
+                buf = capture_map(fd);
+            }
+        } else {
+            last_status = 127;
+        }
+        close(fd);
+    }
+    if (buf == NULL) {
+        if (lenp) *lenp = 0;
+        return "";
+    }
+
+    // Trailing newlines are cut in place
+    while (buf->used > 0 && buf->data[buf->used - 1] == '\n') buf->used--;
+    buf->data[buf->used] = '\0';
+    buf->next = cmd_arena.large;
+    cmd_arena.large = buf;
+    if (lenp) *lenp = buf->used;
+    return buf->data;
+}
+
+// Expanded copy of an argument vector, or argv itself if nothing expands
+char** expand_argv(char** argv) {
+    int argc = 0, special = 0;
+    for (; argv[argc] != NULL; argc++) {
+        if (strpbrk(argv[argc], "$`'\"\\") != NULL || (!glob_off && glob_magic(argv[argc]))) special = 1;
+    }
+    if (!special) return argv;
+
+    // A pattern is replaced by its matches, or left as it is if none
+    size_t cap = argc + 1, n = 0;
+    char** copy = arena_alloc(&cmd_arena, sizeof(char*) * cap);
+    for (int i = 0; i < argc; i++) {
+        if (glob_off) {
+            copy[n++] = expand_word(argv[i]);
+            continue;
+        }
+        char* word = expand_pattern(argv[i]);
+        size_t matches = 0;
+        char** found = glob_magic(word) ? glob_expand(word, &matches) : NULL;
+        if (found == NULL) {
+            copy[n++] = glob_unescape(word);
+            continue;
+        }
+        if (n + matches + (argc - i) > cap) {
+            cap = (n + matches + (argc - i)) * 2;
+            char** bigger = arena_alloc(&cmd_arena, sizeof(char*) * cap);
+            memcpy(bigger, copy, sizeof(char*) * n);
+            copy = bigger;
+        }
+        memcpy(copy + n, found, sizeof(char*) * matches);
+        n += matches;
+    }
+    copy[n] = NULL;
+    return copy;
+}
+
+// Does the word contain *, ? or a closed [...] not escaped by a backslash?
+int glob_magic(const char* word) {
+    for (const char* p = word; *p != '\0'; p++) {
+        if (*p == '\\' && p[1] != '\0') p++;
+        else if (*p == '*' || *p == '?') return 1;
+        else if (*p == '[' && strchr(p + 1, ']') != NULL) return 1;
+    }
+    return 0;
+}
+
+// Remove the backslashes expand_pattern() added, in place
+char* glob_unescape(char* word) {
+    char* src = strchr(word, '\\');
+    if (src == NULL) return word;
+    char* dst = src;
+    for (; *src != '\0'; src++) {
+        if (*src == '\\' && src[1] != '\0') src++;
+        *dst++ = *src;
+    }
+    *dst = '\0';
+    return word;
+}
+
+// Match c against the [...] class at p. Returns the character after the
+// class, or NULL if it is never closed and so is a plain '['.
+const char* glob_class(const char* p, unsigned char c, int* hit) {
+    int negate = p[1] == '!' || p[1] == '^';
+    const char* q = p + 1 + negate;
+    *hit = 0;
+    do {  // a ']' straight after the '[' is part of the class
+        unsigned char lo = *q, hi = lo;
+        if (lo == '\0') return NULL;
+        if (q[1] == '-' && q[2] != ']' && q[2] != '\0') {
+            hi = q[2];
+            q += 2;
+        }
+        if (c >= lo && c <= hi) *hit = 1;
+        q++;
+    } while (*q != ']');
+    *hit ^= negate;
+    return q + 1;
+}
+
+// Match one file name against one pattern component. A '*' remembers where
+// it started so a later mismatch retries one character further on; that is
+// enough because any earlier '*' could only match less.
+int glob_match(const char* pat, const char* name) {
+    const char* star = NULL;
+    const char* retry = NULL;
+    while (*name != '\0') {
+        if (*pat == '*') {
+            star = ++pat;
+            retry = name;
+            continue;
+        }
+        if (*pat == '?') {
+            pat++;
+            name++;
+            continue;
+        }
+        if (*pat == '\\' && pat[1] != '\0') {
+            if (pat[1] == *name) {
+                pat += 2;
+                name++;
+                continue;
+            }
+        } else if (*pat == '[') {
+            int hit;
+            const char* next = glob_class(pat, *name, &hit);
+            if (next != NULL ? hit : *name == '[') {
+                pat = next != NULL ? next : pat + 1;
+                name++;
+                continue;
+            }
+        } else if (*pat == *name) {
+            pat++;
+            name++;
+            continue;
+        }
+        if (star == NULL) return 0;
+        pat = star;
+        name = ++retry;
+    }
+    while (*pat == '*') pat++;
+    return *pat == '\0';
+}
+
+// dir + '/' + name, malloc'd
+char* glob_join(const char* dir, const char* name) {
+    size_t dlen = strlen(dir), nlen = strlen(name);
+    int slash = dlen > 0 && dir[dlen - 1] != '/';
+    char* path = malloc(dlen + slash + nlen + 1);
+    if (path == NULL) {
+        perror("malloc failed");
+        exit(1);
+    }
+    memcpy(path, dir, dlen);
+    if (slash) path[dlen] = '/';
+    memcpy(path + dlen + slash, name, nlen + 1);
+    return path;
+}
+
+void glob_found(GlobWorker* w, const char* dir, const char* name) {
+    size_t dlen = strlen(dir);
+    if (w->found == NULL) w->found = chunk_new(ARENA_CHUNK);
+    if (dlen > 0) {
+        capture_append(&w->found, dir, dlen);
+        if (dir[dlen - 1] != '/') capture_append(&w->found, "/", 1);
+    }
+    capture_append(&w->found, name, strlen(name));
+    capture_append(&w->found, w->glob->dir_only ? "/" : "", w->glob->dir_only ? 2 : 1);
+    w->nfound++;
+}
+
+void glob_push(GlobWorker* w, char* dir, int comp) {
+    atomic_fetch_add(&w->glob->pending, 1);
+    pthread_mutex_lock(&w->lock);
+    if (w->tail == w->cap) {
+        if (w->head > 0) {
+            memmove(w->tasks, w->tasks + w->head, sizeof(GlobTask) * (w->tail - w->head));
+            w->tail -= w->head;
+            w->head = 0;
+        } else {
+            w->cap = w->cap ? w->cap * 2 : 64;
+            w->tasks = realloc(w->tasks, sizeof(GlobTask) * w->cap);
+            if (w->tasks == NULL) {
+                perror("realloc failed");
+                exit(1);
+            }
+        }
+    }
+    w->tasks[w->tail].dir = dir;
+    w->tasks[w->tail].comp = comp;
+    w->tail++;
+    pthread_mutex_unlock(&w->lock);
+}
+
+// Take the newest task of our own deque, or the oldest of someone else's:
+// old tasks sit near the top of the tree and carry the most work
+int glob_take(GlobWorker* w, int steal, GlobTask* t) {
+    int got = 0;
+    pthread_mutex_lock(&w->lock);
+    if (w->tail > w->head) {
+        *t = steal ? w->tasks[w->head++] : w->tasks[--w->tail];
+        got = 1;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return got;
+}
+
+// Is the entry a directory? d_type answers without a stat unless the file
+// system leaves it unknown, or it is a symlink we were asked to follow.
+int glob_is_dir(int dirfd, struct dirent64* e, int follow) {
+    if (e->d_type == DT_DIR) return 1;
+    if (e->d_type != DT_UNKNOWN && (e->d_type != DT_LNK || !follow)) return 0;
+    struct stat st;
+    return fstatat(dirfd, e->d_name, &st, follow ? 0 : AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+}
+
+// Match the entries of t.dir against component t.comp. Directories that
+// lead further into the pattern become new tasks; last-component matches
+// are recorded. A "**" component queues every subdirectory with the same
+// component and the directory itself with the next one.
+void glob_run(GlobWorker* w, GlobTask t) {
+    Glob* g = w->glob;
+    const char* pat = g->comps[t.comp];
+    int last = t.comp == g->ncomps - 1;
+    int globstar = strcmp(pat, "**") == 0;
+
+    // A literal component needs no directory read
+    if (g->literal[t.comp] != NULL) {
+        pat = g->literal[t.comp];
+        char* path = glob_join(t.dir, pat);
+        struct stat st;
+        if (!last) {
+            glob_push(w, path, t.comp + 1);
+            path = NULL;
+        } else if (g->dir_only ? stat(path, &st) == 0 && S_ISDIR(st.st_mode) : lstat(path, &st) == 0) {
+            glob_found(w, t.dir, pat);
+        }
+        free(path);
+        return;
+    }
+    if (globstar && !last) glob_push(w, strdup(t.dir), t.comp + 1);
+
+    int fd = open(t.dir[0] != '\0' ? t.dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return;
+    ssize_t n;
+    while ((n = getdents64(fd, w->dirbuf, GLOB_DIRBUF)) > 0) {
+        for (ssize_t off = 0; off < n;) {
+            struct dirent64* e = (struct dirent64*)(w->dirbuf + off);
+            off += e->d_reclen;
+            const char* name = e->d_name;
+            // Dot files only match a pattern that starts with a dot
+            if (name[0] == '.' && (pat[0] != '.' || name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+            if (globstar) {
+                int dir = glob_is_dir(fd, e, 0);
+                if (dir) glob_push(w, glob_join(t.dir, name), t.comp);
+                if (last && (dir || !g->dir_only)) glob_found(w, t.dir, name);
+            } else if (glob_match(pat, name)) {
+                if (!last) {
+                    if (glob_is_dir(fd, e, 1)) glob_push(w, glob_join(t.dir, name), t.comp + 1);
+                } else if (!g->dir_only || glob_is_dir(fd, e, 1)) {
+                    glob_found(w, t.dir, name);
+                }
+            }
+        }
+    }
+    close(fd);
+}
+
+void* glob_worker(void* arg) {
+    GlobWorker* w = arg;
+    Glob* g = w->glob;
+    GlobTask t;
+    for (;;) {
+        int got = glob_take(w, 0, &t);
+        for (int i = 1; !got && i < g->nworkers; i++) {
+            got = glob_take(&g->workers[(w->id + i) % g->nworkers], 1, &t);
+        }
+        if (!got) {
+            if (atomic_load(&g->pending) == 0) return NULL;
+            sched_yield();
+            continue;
+        }
+        glob_run(w, t);
+        free(t.dir);
+        atomic_fetch_sub(&g->pending, 1);
+    }
+}
+
+int glob_compare(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Expand a pattern into the paths it matches, allocated in cmd_arena.
+// Returns NULL if nothing matches. Patterns with a "**" component are
+// walked by a pool of threads that steal directories from each other;
+// the calling thread is one of them.
+char** glob_expand(const char* pattern, size_t* count) {
+    unsigned long long start = trace_begin();
+    Glob g;
+    char* copy = arena_strdup(&cmd_arena, pattern);
+    size_t len = strlen(copy);
+    g.dir_only = len > 1 && copy[len - 1] == '/';
+    g.comps = arena_alloc(&cmd_arena, sizeof(char*) * (len / 2 + 1));
+    g.literal = arena_alloc(&cmd_arena, sizeof(char*) * (len / 2 + 1));
+    g.ncomps = 0;
+    int recursive = 0;
+    for (char* c = strtok(copy, "/"); c != NULL; c = strtok(NULL, "/")) {
+        if (strcmp(c, "**") == 0) recursive = 1;
+        g.literal[g.ncomps] = glob_magic(c) ? NULL : glob_unescape(arena_strdup(&cmd_arena, c));
+        g.comps[g.ncomps++] = c;
+    }
+    if (g.ncomps == 0) return NULL;
+
+    g.nworkers = 1;
+    if (recursive) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        g.nworkers = cpus < 1 ? 1 : cpus > GLOB_THREADS ? GLOB_THREADS : cpus;
+    }
+    GlobWorker workers[GLOB_THREADS];
+    pthread_t threads[GLOB_THREADS];
+    g.workers = workers;
+    atomic_init(&g.pending, 0);
+    for (int i = 0; i < g.nworkers; i++) {
+        memset(&workers[i], 0, sizeof(GlobWorker));
+        pthread_mutex_init(&workers[i].lock, NULL);
+        workers[i].glob = &g;
+        workers[i].id = i;
+        workers[i].dirbuf = malloc(GLOB_DIRBUF);
+        if (workers[i].dirbuf == NULL) {
+            perror("malloc failed");
+            exit(1);
+        }
+    }
+    glob_push(&workers[0], strdup(pattern[0] == '/' ? "/" : ""), 0);
+    // A worker whose thread cannot be started only leaves an empty deque
+    int started = 1;
+    while (started < g.nworkers &&
+           pthread_create(&threads[started], NULL, glob_worker, &workers[started]) == 0) {
+        started++;
+    }
+    glob_worker(&workers[0]);
+    for (int i = 1; i < started; i++) pthread_join(threads[i], NULL);
+
+    // The match buffers become arena chunks and the results point into them
+    size_t total = 0;
+    for (int i = 0; i < g.nworkers; i++) total += workers[i].nfound;
+    char** found = total > 0 ? arena_alloc(&cmd_arena, sizeof(char*) * total) : NULL;
+    size_t n = 0;
+    for (int i = 0; i < g.nworkers; i++) {
+        GlobWorker* w = &workers[i];
+        if (w->found != NULL) {
+            for (char* p = w->found->data; n < total && p < w->found->data + w->found->used; p += strlen(p) + 1) {
+                found[n++] = p;
+            }
+            w->found->next = cmd_arena.large;
+            cmd_arena.large = w->found;
+        }
+        free(w->tasks);
+        free(w->dirbuf);
+        pthread_mutex_destroy(&w->lock);
+    }
+    if (glob_sort && total > 1) qsort(found, total, sizeof(char*), glob_compare);
+    *count = total;
+    trace_span("glob", pattern, start, 0, -1);
+    return found;
+}
+
+// Shell variables; exported ones are listed by export and printenv
+void list_user_variables() {
+    out_printf("User-defined variables:\n");
+    for (size_t i = 0; i < variable_count; i++) {
+        if (variables[i].value == NULL || variables[i].exported) continue;
+        out_printf("%s=%s\n", variables[i].name, variables[i].value->data);
+    }
+}
+
+// FNV-1a
+unsigned long hash_string(const char* s) {
+    unsigned long h = 1469598103934665603UL;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+// Resolve a command name to the executable that execvp() would run, using
+// the cache when possible. Names containing '/' are used as they are.
+// Returns NULL when nothing on $PATH matches.
+char* lookup_command(const char* name) {
+    if (strchr(name, '/') != NULL) return (char*)name;
+
+    const char* pathvar = get_variable_value("PATH");
+    if (pathvar == NULL) pathvar = "/usr/local/bin:/usr/bin:/bin";
+    if (path_cache_key == NULL || strcmp(path_cache_key, pathvar) != 0) {
+        path_cache_clear();
+        path_cache_key = strdup(pathvar);
+    }
+
+    unsigned long h = hash_string(name);
+    if (path_cache_cap > 0) {
+        for (size_t i = h & (path_cache_cap - 1); path_cache[i].name != NULL;
+             i = (i + 1) & (path_cache_cap - 1)) {
+            if (strcmp(path_cache[i].name, name) == 0) {
+                path_hits++;
+                path_cache[i].hits++;
+                return path_cache[i].path;
+            }
+        }
+    }
+    path_misses++;
+
+    // Walk $PATH the way execvp() does, but only once per command
+    char candidate[4096];
+    const char* dir = pathvar;
+    char* found = NULL;
+    for (;;) {
+        const char* colon = strchr(dir, ':');
+        size_t dirlen = colon ? (size_t)(colon - dir) : strlen(dir);
+        int n;
+        if (dirlen == 0) n = snprintf(candidate, sizeof(candidate), "%s", name);
+        else n = snprintf(candidate, sizeof(candidate), "%.*s/%s", (int)dirlen, dir, name);
+        struct stat st;
+        if (n > 0 && (size_t)n < sizeof(candidate) && access(candidate, X_OK) == 0 &&
+            stat(candidate, &st) == 0 && S_ISREG(st.st_mode)) {
+            found = candidate;
+            break;
+        }
+        if (colon == NULL) break;
+        dir = colon + 1;
+    }
+    if (found == NULL) return NULL;
+
+    if ((path_cache_count + 1) * 4 > path_cache_cap * 3) {
+        size_t newcap = path_cache_cap ? path_cache_cap * 2 : 64;
+        PathEntry* table = calloc(newcap, sizeof(PathEntry));
+        for (size_t i = 0; i < path_cache_cap; i++) {
+            if (path_cache[i].name == NULL) continue;
+            size_t j = hash_string(path_cache[i].name) & (newcap - 1);
+            while (table[j].name != NULL) j = (j + 1) & (newcap - 1);
+            table[j] = path_cache[i];
+        }
+        free(path_cache);
+        path_cache = table;
+        path_cache_cap = newcap;
+    }
+    size_t i = h & (path_cache_cap - 1);
+    while (path_cache[i].name != NULL) i = (i + 1) & (path_cache_cap - 1);
+    path_cache[i].name = strdup(name);
+    path_cache[i].path = strdup(found);
+    path_cache[i].hits = 0;
+    path_cache_count++;
+    return path_cache[i].path;
+}
+
+// Drop one entry, shifting later members of its probe run back so lookups
+// never stop early at the hole
+void path_cache_forget(const char* name) {
+    if (path_cache_cap == 0) return;
+    size_t mask = path_cache_cap - 1;
+    size_t i = hash_string(name) & mask;
+    while (path_cache[i].name != NULL && strcmp(path_cache[i].name, name) != 0)
+        i = (i + 1) & mask;
+    if (path_cache[i].name == NULL) return;
+
+    free(path_cache[i].name);
+    free(path_cache[i].path);
+    path_cache[i].name = NULL;
+    path_cache_count--;
+    for (size_t j = (i + 1) & mask; path_cache[j].name != NULL; j = (j + 1) & mask) {
+        size_t home = hash_string(path_cache[j].name) & mask;
+        // Move the entry into the hole if the hole lies on its probe path
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            path_cache[i] = path_cache[j];
+            path_cache[j].name = NULL;
+            i = j;
+        }
+    }
+}
+
+void path_cache_clear() {
+    for (size_t i = 0; i < path_cache_cap; i++) {
+        if (path_cache[i].name != NULL) {
+            free(path_cache[i].name);
+            free(path_cache[i].path);
+            path_cache[i].name = NULL;
+        }
+    }
+    path_cache_count = 0;
+    free(path_cache_key);
+    path_cache_key = NULL;
+}
+
+void path_cache_list() {
+    if (path_cache_count == 0) {
+        out_printf("hash: hash table empty\n");
+    } else {
+        out_printf("hits\tcommand\n");
+        for (size_t i = 0; i < path_cache_cap; i++) {
+            if (path_cache[i].name != NULL)
+                out_printf("%4lu\t%s\n", path_cache[i].hits, path_cache[i].path);
+        }
+    }
+    out_printf("lookups: %lu hits, %lu misses\n", path_hits, path_misses);
+}
+
+int builtin_cd(char** arglist) {
+    if (arglist[1] == NULL) {
+        fprintf(stderr, "cd: missing argument\n");
+        return 1;
+    }
+    if (chdir(arglist[1]) != 0) {
+        perror("cd failed");
+        return 1;
+    }
+    return 0;
+}
+
+int builtin_exit(char** arglist) {
+    out_printf("Exiting shell...\n");
+    exit(arglist[1] != NULL ? atoi(arglist[1]) : 0);
+}
+
+int builtin_jobs(char** arglist) {
+    list_jobs(arglist[1] != NULL && strcmp(arglist[1], "-l") == 0);
+    return 0;
+}
+
+// `run [options] %n` changes a live job. Starting a command under `run` is
+// handled where commands are dispatched, so only that form reaches here.
+int builtin_run(char** arglist) {
+    Placement p;
+    int first = placement_parse(arglist, &p, 0);
+    if (first < 0) return 2;
+    if (arglist[first] == NULL) {
+        fprintf(stderr, "run: usage: run [--cpus LIST] [--nice N] [--sched POLICY] [--io CLASS] cmd|%%job\n");
+        return 2;
+    }
+    Job* job = find_job(arglist[first]);
+    if (job == NULL || job->state == JOB_DONE) {
+        fprintf(stderr, "run: %s: no such job\n", arglist[first]);
+        return 1;
+    }
+    int status = 0;
+    for (int i = 0; i < job->nprocs; i++) {
+        if (job->procs[i].done) continue;
+        if (placement_apply(job->procs[i].pid, &p) < 0) {
+            fprintf(stderr, "run: %d: %s\n", job->procs[i].pid, strerror(errno));
+            status = 1;
+        }
+    }
+    placement_merge(&job->place, &p);
+    return status;
+}
+
+// wait [-n] [-t seconds] [PID|%job...]. Sleeps in epoll_wait on the job
+// table's pidfds, so each wakeup costs only the processes that exited, and
+// a timeout is one more fd in the same set.
+int builtin_wait(char** arglist) {
+    int any = 0, i = 1;
+    double timeout = -1;
+    for (; arglist[i] != NULL && arglist[i][0] == '-'; i++) {
+        char* end = NULL;
+        if (strcmp(arglist[i], "-n") == 0) {
+            any = 1;
+            continue;
+        }
+        if (strcmp(arglist[i], "-t") == 0 && arglist[i + 1] != NULL && arglist[i + 1][0] != '\0') {
+            timeout = strtod(arglist[++i], &end);
+            if (*end == '\0' && timeout >= 0) continue;
+        }
+        fprintf(stderr, "wait: usage: wait [-n] [-t seconds] [PID|%%job...]\n");
+        return 2;
+    }
+
+    int ntargets = 0;
+    while (arglist[i + ntargets] != NULL) ntargets++;
+    // A forked copy of the shell (a pipeline stage, $(...)) has given up the
+    // pidfds; the jobs are the parent's children, not its own
+    if (job_epfd < 0) return any || ntargets > 0 ? 127 : 0;
+    Job** tjobs = arena_alloc(&cmd_arena, sizeof(Job*) * (ntargets + 1));
+    JobProc** tprocs = arena_alloc(&cmd_arena, sizeof(JobProc*) * (ntargets + 1));
+    for (int k = 0; k < ntargets; k++) {
+        const char* arg = arglist[i + k];
+        tprocs[k] = arg[0] != '%' ? job_proc_any(atoi(arg)) : NULL;
+        tjobs[k] = arg[0] == '%' ? find_job(arg) : tprocs[k] != NULL ? tprocs[k]->job : NULL;
+        if (tjobs[k] == NULL) {
+            if (arg[0] == '%') fprintf(stderr, "wait: %s: no such job\n", arg);
+            else fprintf(stderr, "wait: pid %s is not a child of this shell\n", arg);
+            return 127;
+        }
+    }
+
+    int timer = -1;
+    job_timer_fired = 0;
+    if (timeout >= 0) {
+        struct itimerspec its = { { 0, 0 }, { (time_t)timeout, (long)((timeout - (time_t)timeout) * 1e9) } };
+        if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) its.it_value.tv_nsec = 1;
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+        timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        if (timer < 0 || timerfd_settime(timer, 0, &its, NULL) < 0 ||
+            epoll_ctl(job_epfd, EPOLL_CTL_ADD, timer, &ev) < 0) {
+            perror("wait: timer");
+            if (timer >= 0) close(timer);
+            return 1;
+        }
+    }
+
+    int status = 0, waited = -1;  // waited: the target that -n returned for
+    for (;;) {
+        int done = 0;
+        if (ntargets == 0) {
+            done = any ? finished_count > 0 : job_count == finished_count;
+        } else {
+            int left = 0;
+            for (int k = 0; k < ntargets; k++) {
+                int over = tprocs[k] != NULL ? tprocs[k]->done : tjobs[k]->state == JOB_DONE;
+                if (!over) {
+                    left++;
+                } else if (any && waited < 0) {
+                    waited = k;
+                }
+            }
+            done = any ? waited >= 0 : left == 0;
+        }
+        if (done) break;
+        if (job_count == finished_count) {
+            // -n with nothing left running
+            status = 127;
+            break;
+        }
+        if (job_timer_fired) {
+            status = 124;
+            break;
+        }
+        jobs_poll(jobs_without_pidfd > 0 ? 100 : -1);
+    }
+    if (timer >= 0) close(timer);
+    if (status != 0) return status;
 
-// Structure to keep track of background jobs
-typedef struct {
-    pid_t pid;
-    char command[MAX_LEN];
-} Job;
+    // Jobs that were waited for are not reported at the next prompt
+    if (ntargets == 0 && any) {
+        status = finished[0]->status;
+        job_forget(finished[0]);
+    } else if (ntargets == 0) {
+        while (finished_count > 0) job_forget(finished[0]);
+    } else {
+        int last = any ? waited : ntargets - 1;
+        status = tprocs[last] != NULL ? pipeline_status(&tprocs[last]->status, 1) : tjobs[last]->status;
+        for (int k = 0; k < ntargets; k++) {
+            int dup = 0;
+            for (int j = 0; j < k; j++) dup |= tjobs[j] == tjobs[k];
+            if (!dup && tjobs[k]->state == JOB_DONE) job_forget(tjobs[k]);
+            if (any) break;
+        }
+    }
+    return status;
+}
 
-// Structure to store user-defined variables
-typedef struct {
-    char name[ARGLEN];
-    char value[MAX_LEN];
-} Variable;
+// joblog lists the captured logs; joblog %n prints one, -d discards it
+int builtin_joblog(char** arglist) {
+    int discard = arglist[1] != NULL && strcmp(arglist[1], "-d") == 0;
+    const char* spec = arglist[1 + discard];
+    if (spec == NULL) {
+        if (discard) {
+            fprintf(stderr, "joblog: usage: joblog [-d] [%%job|PID]\n");
+            return 2;
+        }
+        for (int id = 1; id <= job_log_slots; id++) {
+            JobLog* log = job_logs[id - 1];
+            if (log == NULL) continue;
+            if (job_epfd >= 0) joblog_drain(log, JOBLOG_READS);
+            out_printf("[%d]  %-8s %zu bytes, %zu on disk\t%s\n", id,
+                       log->fd >= 0 ? "Running" : "Done", log->total, log->spilled, log->command);
+        }
+        return 0;
+    }
+    int id = 0;
+    if (spec[0] == '%') {
+        id = atoi(spec + 1);
+    } else {
+        Job* job = find_job(spec);
+        if (job != NULL) id = job->id;
+    }
+    JobLog* log = id >= 1 && id <= job_log_slots ? job_logs[id - 1] : NULL;
+    if (log == NULL) {
+        fprintf(stderr, "joblog: %s: no captured output\n", spec);
+        return 1;
+    }
+    if (discard) {
+        if (job_epfd < 0) {
+            fprintf(stderr, "joblog: -d cannot be used in a pipeline\n");
+            return 2;
+        }
+        job_logs[id - 1] = NULL;
+        joblog_free(log);
+        return 0;
+    }
+    // Catch up with everything written so far, within reason: a job that
+    // never stops writing must not keep us here
+    if (job_epfd >= 0) joblog_drain(log, JOBLOG_READS * 64);
+    joblog_print(log);
+    if (log->lost > 0) {
+        fprintf(stderr, "joblog: %%%d: %zu bytes could not be written to the spill file\n",
+                id, log->lost);
+    }
+    return 0;
+}
 
-// Global variables for command history, jobs, and user-defined variables
-char* history[HISTORY_SIZE];
-int history_count = 0;
-Job jobs[MAX_JOBS];
-int job_count = 0;
-Variable variables[MAX_VARIABLES];
-int variable_count = 0;
+int builtin_kill(char** arglist) {
+    if (arglist[1] == NULL) {
+        fprintf(stderr, "kill: missing PID\n");
+        return 1;
+    }
+    if (arglist[1][0] == '%') {
+        Job* job = find_job(arglist[1]);
+        if (job == NULL || job->state == JOB_DONE) {
+            fprintf(stderr, "kill: %s: no such job\n", arglist[1]);
+            return 1;
+        }
+        if (killpg(job->pgid, SIGKILL) != 0) {
+            perror("Failed to kill job");
+            return 1;
+        }
+        out_printf("Job %d killed.\n", job->id);
+        return 0;
+    }
+    pid_t pid = atoi(arglist[1]);
+    if (kill(pid, SIGKILL) != 0) {
+        perror("Failed to kill process");
+        return 1;
+    }
+    out_printf("Process %d killed.\n", pid);
+    return 0;
+}
 
-int main() {
-    // Initialize history and jobs
-    for (int i = 0; i < HISTORY_SIZE; i++) {
-        history[i] = NULL;
+int builtin_help(char** arglist);
+int builtin_parallel(char** arglist);
+int builtin_set(char** arglist);
+int builtin_compgen(char** arglist);
+
+int builtin_listvars(char** arglist) {
+    list_user_variables();
+    return 0;
+}
+
+// Prints exactly what a command started now would get
+int builtin_printenv(char** arglist) {
+    if (arglist[1] == NULL) {
+        for (char** e = env_build(); *e != NULL; e++) out_printf("%s\n", *e);
+        return 0;
     }
+    int status = 0;
+    for (int i = 1; arglist[i] != NULL; i++) {
+        Variable* v = find_variable(arglist[i], hash_string(arglist[i]));
+        if (v != NULL && v->exported && v->value != NULL) out_printf("%s\n", v->value->data);
+        else status = 1;
+    }
+    return status;
+}
 
-    signal(SIGCHLD, handle_sigchld);
+// Is s a variable name: a letter or _, then letters, digits and _?
+int valid_name(const char* s, size_t n) {
+    if (n == 0 || !(isalpha((unsigned char)s[0]) || s[0] == '_')) return 0;
+    for (size_t i = 1; i < n; i++) {
+        if (!(isalnum((unsigned char)s[i]) || s[i] == '_')) return 0;
+    }
+    return 1;
+}
 
-    char *cmdline;
-    char** arglist;
-    char* prompt = PROMPT;   
-    while ((cmdline = read_cmd(prompt, stdin)) != NULL) {
-        trim_whitespace(cmdline);
-
-        // Check if command is a variable assignment or retrieval
-        if (handle_variable(cmdline)) {
-            free(cmdline);
+// export NAME[=value]... marks variables to be passed to commands (a name
+// that is not set yet is passed once it is); alone, lists the exported ones
+int builtin_export(char** arglist) {
+    if (arglist[1] == NULL) {
+        for (size_t i = 0; i < variable_count; i++) {
+            Variable* v = &variables[i];
+            if (v->exported && v->value != NULL) out_printf("export %s=%s\n", v->name, v->value->data);
+        }
+        return 0;
+    }
+    int status = 0;
+    for (int i = 1; arglist[i] != NULL; i++) {
+        char* eq = strchr(arglist[i], '=');
+        size_t n = eq != NULL ? (size_t)(eq - arglist[i]) : strlen(arglist[i]);
+        if (!valid_name(arglist[i], n)) {
+            fprintf(stderr, "export: %s: not a valid identifier\n", arglist[i]);
+            status = 1;
             continue;
         }
+        char* name = arena_strndup(&cmd_arena, arglist[i], n);
+        if (eq != NULL) set_variable(name, eq + 1);
+        Variable* v = variable_entry(name, hash_string(name));
+        if (!v->exported && v->value != NULL) env_dirty = 1;
+        v->exported = 1;
+    }
+    return status;
+}
 
-        // Check if the user wants to repeat a command using `!number`
-        if (cmdline[0] == '!') {
-            int history_index;
-            if (cmdline[1] == '-') {
-                history_index = history_count - 1;
-            } else {
-                history_index = atoi(&cmdline[1]) - 1;
-            }
-
-            if (history_index >= 0 && history_index < HISTORY_SIZE && history[history_index] != NULL) {
-                printf("Repeating command: %s\n", history[history_index]);
-                strcpy(cmdline, history[history_index]);
-            } else {
-                printf("Invalid history number!\n");
-                continue;
-            }
-        } else {
-            add_to_history(cmdline);
-        }
+// unset NAME... removes variables, from the environment too
+int builtin_unset(char** arglist) {
+    for (int i = 1; arglist[i] != NULL; i++) {
+        Variable* v = find_variable(arglist[i], hash_string(arglist[i]));
+        if (v == NULL) continue;
+        if (v->exported && v->value != NULL) env_dirty = 1;
+        v->exported = 0;
+        free(v->value);
+        v->value = NULL;
+    }
+    return 0;
+}
 
-        int background = 0;
-        int len = strlen(cmdline);
+int builtin_echo(char** arglist) {
+    int i = 1, newline = 1;
+    if (arglist[1] != NULL && strcmp(arglist[1], "-n") == 0) {
+        newline = 0;
+        i++;
+    }
+    for (int first = i; arglist[i] != NULL; i++) {
+        if (i > first) out_write(" ", 1);
+        out_write(arglist[i], strlen(arglist[i]));
+    }
+    if (newline) out_write("\n", 1);
+    return 0;
+}
 
-        // Check if the command should run in the background
-        if (len > 0 && cmdline[len - 1] == '&') {
-            background = 1;
-            cmdline[len - 1] = '\0'; 
-            trim_whitespace(cmdline);  
+// Write one backslash escape from a printf format; returns its length
+int printf_escape(const char* p) {
+    char c;
+    switch (p[1]) {
+        case 'n': c = '\n'; break;
+        case 't': c = '\t'; break;
+        case 'r': c = '\r'; break;
+        case 'a': c = '\a'; break;
+        case 'b': c = '\b'; break;
+        case 'f': c = '\f'; break;
+        case 'v': c = '\v'; break;
+        case 'e': c = '\033'; break;
+        case '\\': c = '\\'; break;
+        case '0': {
+            int v = 0, n = 2;
+            while (n < 5 && p[n] >= '0' && p[n] <= '7') v = v * 8 + (p[n++] - '0');
+            c = v;
+            out_write(&c, 1);
+            return n;
         }
+        case '\0': c = '\\'; out_write(&c, 1); return 1;
+        default: out_write(p, 2); return 2;
+    }
+    out_write(&c, 1);
+    return 2;
+}
 
-        if (strstr(cmdline, "|")) {
-            handle_pipe(cmdline);
-        } else {
-            if ((arglist = tokenize(cmdline)) != NULL) {
-                if (execute_builtin(arglist) == 0) {
-                    execute(arglist, background);
+// printf FORMAT [ARG...]: %s %b %c %d %i %u %o %x %X %% with flags, width and
+// precision. The format is reused while arguments remain.
+int builtin_printf(char** arglist) {
+    if (arglist[1] == NULL) {
+        fprintf(stderr, "printf: usage: printf format [arguments]\n");
+        return 2;
+    }
+    const char* fmt = arglist[1];
+    char** arg = arglist + 2;
+    int status = 0;
+    do {
+        char** before = arg;
+        for (const char* p = fmt; *p != '\0';) {
+            if (*p == '\\') {
+                p += printf_escape(p);
+                continue;
+            }
+            if (*p != '%') {
+                const char* run = p;
+                while (*p != '\0' && *p != '%' && *p != '\\') p++;
+                out_write(run, p - run);
+                continue;
+            }
+            if (p[1] == '%') {
+                out_write("%", 1);
+                p += 2;
+                continue;
+            }
+            // Copy flags, width and precision into a spec for snprintf
+            char spec[32];
+            size_t n = 0;
+            spec[n++] = *p++;
+            while (*p != '\0' && strchr("-+ #0123456789.", *p) && n < sizeof(spec) - 4) spec[n++] = *p++;
+            char conv = *p;
+            if (conv == '\0') break;
+            p++;
+            const char* value = *arg != NULL ? *arg++ : NULL;
+            switch (conv) {
+                case 'd': case 'i': {
+                    char* end = "";
+                    long long v = value ? strtoll(value, &end, 0) : 0;
+                    if (*end != '\0') {
+                        fprintf(stderr, "printf: %s: invalid number\n", value);
+                        status = 1;
+                    }
+                    strcpy(spec + n, "lld");
+                    out_printf(spec, v);
+                    break;
+                }
+                case 'u': case 'o': case 'x': case 'X': {
+                    char* end = "";
+                    unsigned long long v = value ? strtoull(value, &end, 0) : 0;
+                    if (*end != '\0') {
+                        fprintf(stderr, "printf: %s: invalid number\n", value);
+                        status = 1;
+                    }
+                    spec[n++] = 'l';
+                    spec[n++] = 'l';
+                    spec[n++] = conv;
+                    spec[n] = '\0';
+                    out_printf(spec, v);
+                    break;
                 }
-                for (int j = 0; j < MAXARGS+1; j++)
-                    free(arglist[j]);
-                free(arglist);
-                free(cmdline);
+                case 'c':
+                    if (value != NULL && value[0] != '\0') out_write(value, 1);
+                    break;
+                case 'b':
+                    for (const char* q = value ? value : ""; *q != '\0';) {
+                        if (*q == '\\') {
+                            q += printf_escape(q);
+                        } else {
+                            out_write(q, 1);
+                            q++;
+                        }
+                    }
+                    break;
+                case 's':
+                    spec[n++] = 's';
+                    spec[n] = '\0';
+                    out_printf(spec, value ? value : "");
+                    break;
+                default:
+                    fprintf(stderr, "printf: %%%c: invalid directive\n", conv);
+                    return 1;
             }
         }
+        if (arg == before) break;  // no conversions, do not loop forever
+    } while (*arg != NULL);
+    return status;
+}
+
+int test_unary(const char* op, const char* arg) {
+    struct stat st;
+    switch (op[1]) {
+        case 'n': return arg[0] != '\0';
+        case 'z': return arg[0] == '\0';
+        case 'e': return stat(arg, &st) == 0;
+        case 'f': return stat(arg, &st) == 0 && S_ISREG(st.st_mode);
+        case 'd': return stat(arg, &st) == 0 && S_ISDIR(st.st_mode);
+        case 's': return stat(arg, &st) == 0 && st.st_size > 0;
+        case 'L': case 'h': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+        case 'r': return access(arg, R_OK) == 0;
+        case 'w': return access(arg, W_OK) == 0;
+        case 'x': return access(arg, X_OK) == 0;
     }
-    printf("\n");
-    return 0;
+    return -1;
 }
 
+int test_binary(const char* a, const char* op, const char* b) {
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) return strcmp(a, b) == 0;
+    if (strcmp(op, "!=") == 0) return strcmp(a, b) != 0;
+    if (op[0] != '-' || strlen(op) != 3) return -1;
+    long long x = strtoll(a, NULL, 10), y = strtoll(b, NULL, 10);
+    if (strcmp(op, "-eq") == 0) return x == y;
+    if (strcmp(op, "-ne") == 0) return x != y;
+    if (strcmp(op, "-lt") == 0) return x < y;
+    if (strcmp(op, "-le") == 0) return x <= y;
+    if (strcmp(op, "-gt") == 0) return x > y;
+    if (strcmp(op, "-ge") == 0) return x >= y;
+    return -1;
+}
 
-// Trim whitespace from both ends of a string
-void trim_whitespace(char* str) {
-    while (isspace((unsigned char)*str)) str++;
-    if (*str == 0) return;
-    char* end = str + strlen(str) - 1;
-    while (end > str && isspace((unsigned char)*end)) end--;
-    *(end + 1) = '\0';
+// POSIX test by argument count. Returns 1 true, 0 false, -1 on bad syntax.
+int test_eval(char** argv, int argc) {
+    if (argc == 0) return 0;
+    if (strcmp(argv[0], "!") == 0 && argc <= 4) {
+        int r = test_eval(argv + 1, argc - 1);
+        return r < 0 ? r : !r;
+    }
+    switch (argc) {
+        case 1: return argv[0][0] != '\0';
+        case 2: return argv[0][0] == '-' && strlen(argv[0]) == 2 ? test_unary(argv[0], argv[1]) : -1;
+        case 3: return test_binary(argv[0], argv[1], argv[2]);
+    }
+    return -1;
 }
 
-// Add command to history
-void add_to_history(char* command) {
-    if (history_count < HISTORY_SIZE) {
-        history[history_count] = strdup(command);
-        history_count++;
-    } else {
-        free(history[0]);
-        for (int i = 1; i < HISTORY_SIZE; i++) {
-            history[i - 1] = history[i];
+int builtin_test(char** arglist) {
+    int argc = 0;
+    while (arglist[argc + 1] != NULL) argc++;
+    if (strcmp(arglist[0], "[") == 0) {
+        if (argc == 0 || strcmp(arglist[argc], "]") != 0) {
+            fprintf(stderr, "[: missing ]\n");
+            return 2;
         }
-        history[HISTORY_SIZE - 1] = strdup(command);
+        argc--;
+    }
+    int r = test_eval(arglist + 1, argc);
+    if (r < 0) {
+        fprintf(stderr, "%s: syntax error\n", arglist[0]);
+        return 2;
     }
+    return !r;
 }
 
-// Signal handler for SIGCHLD
-void handle_sigchld(int sig) {
-    int saved_errno = errno;
-    while (waitpid(-1, NULL, WNOHANG) > 0);
-    errno = saved_errno;
+int builtin_true(char** arglist) {
+    return 0;
 }
 
-// Tokenize input command into arguments
-char** tokenize(char* cmdline) {
-    char** arglist = malloc(sizeof(char*) * (MAXARGS + 1));
-    for (int j = 0; j < MAXARGS + 1; j++) {
-        arglist[j] = malloc(sizeof(char) * ARGLEN);
-        bzero(arglist[j], ARGLEN);
-    }
-    if (cmdline[0] == '\0') return NULL;
-    int argnum = 0;
-    char* cp = cmdline;
-    char* start;
-    int len;
-    while (*cp != '\0') {
-        while (*cp == ' ' || *cp == '\t') cp++;
-        start = cp;
-        len = 1;
-        while (*++cp != '\0' && !(*cp == ' ' || *cp == '\t')) len++;
-        strncpy(arglist[argnum], start, len);
-        arglist[argnum][len] = '\0';
-        argnum++;
-    }
-    arglist[argnum] = NULL;
-    return arglist;
+int builtin_false(char** arglist) {
+    return 1;
 }
 
-// Read command input
-char* read_cmd(char* prompt, FILE* fp) {
-    printf("%s", prompt);
-    int c;
-    int pos = 0;
-    char* cmdline = malloc(sizeof(char) * MAX_LEN);
-    while ((c = getc(fp)) != EOF) {
-        if (c == '\n') break;
-        cmdline[pos++] = c;
+int builtin_pwd(char** arglist) {
+    char* cwd = getcwd(NULL, 0);
+    if (cwd == NULL) {
+        perror("pwd");
+        return 1;
     }
-    if (c == EOF && pos == 0) return NULL;
-    cmdline[pos] = '\0';
-    return cmdline;
+    out_printf("%s\n", cwd);
+    free(cwd);
+    return 0;
 }
 
-// Execute command
-int execute(char* arglist[], int background) {
-    int status;
-    int cpid = fork();
-    switch(cpid) {
-        case -1:
-            perror("fork failed");
-            exit(1);
-        case 0:
-            execvp(arglist[0], arglist);
-            perror("Command not found...");
-            exit(1);
-        default:
-            if (!background) waitpid(cpid, &status, 0);
-            return 0;
+// read [-r] [name...]: read one line from stdin and split it on blanks; the
+// last name gets the rest of the line. The shell's own input is read through
+// its line reader so no script text is lost; any other stdin is read a byte
+// at a time so nothing past the line is consumed.
+int builtin_read(char** arglist) {
+    int raw = 0, i = 1;
+    if (arglist[1] != NULL && strcmp(arglist[1], "-r") == 0) {
+        raw = 1;
+        i++;
     }
-}
-int handle_redirection(char** arglist) {
-    int i = 0;
-    while (arglist[i] != NULL) {
-        if (strcmp(arglist[i], "<") == 0) {
-            int fd = open(arglist[i+1], O_RDONLY);
-            if (fd < 0) {
-                perror("Failed to open input file");
-                exit(1);
+    char** names = arglist + i;
+    char* line;
+    size_t len = 0;
+    if (!stdin_redirected && stdin_reader.buf != NULL) {
+        out_flush();
+        line = reader_next_line(&stdin_reader, &len);
+        if (line == NULL) return 1;
+        line = arena_strndup(&cmd_arena, line, len);
+    } else {
+        size_t cap = 128;
+        line = arena_alloc(&cmd_arena, cap);
+        for (;;) {
+            char c;
+            ssize_t n = read(STDIN_FILENO, &c, 1);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                if (len == 0) return 1;
+                break;
             }
-            dup2(fd, STDIN_FILENO);
-            close(fd);
-            arglist[i] = NULL; // Remove redirection part from args
-        } else if (strcmp(arglist[i], ">") == 0) {
-            int fd = open(arglist[i+1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (fd < 0) {
-                perror("Failed to open output file");
-                exit(1);
+            if (c == '\n') break;
+            if (len + 2 > cap) {
+                char* bigger = arena_alloc(&cmd_arena, cap * 2);
+                memcpy(bigger, line, len);
+                line = bigger;
+                cap *= 2;
             }
-            dup2(fd, STDOUT_FILENO);
-            close(fd);
-            arglist[i] = NULL; // Remove redirection part from args
+            line[len++] = c;
         }
-        i++;
+        line[len] = '\0';
+    }
+
+    // Without -r a backslash keeps the next character literally
+    if (!raw) {
+        char* w = line;
+        for (char* p = line; *p != '\0'; p++) {
+            if (*p == '\\' && p[1] != '\0') p++;
+            *w++ = *p;
+        }
+        *w = '\0';
+    }
+
+    if (names[0] == NULL) {
+        set_variable("REPLY", line);
+        return 0;
+    }
+    char* p = line;
+    for (int k = 0; names[k] != NULL; k++) {
+        while (*p == ' ' || *p == '\t') p++;
+        char* field = p;
+        if (names[k + 1] == NULL) {
+            field = trim_whitespace(p);
+        } else {
+            while (*p != '\0' && *p != ' ' && *p != '\t') p++;
+            if (*p != '\0') *p++ = '\0';
+        }
+        set_variable(names[k], field);
+    }
+    return 0;
+}
+
+int builtin_launcher(char** arglist) {
+    if (arglist[1] == NULL) {
+        out_printf("%s\n", launcher == LAUNCH_SPAWN ? "spawn" : launcher == LAUNCH_FORK ? "fork" : "zygote");
+    } else if (strcmp(arglist[1], "fork") == 0) {
+        launcher = LAUNCH_FORK;
+    } else if (strcmp(arglist[1], "spawn") == 0) {
+        launcher = LAUNCH_SPAWN;
+    } else if (strcmp(arglist[1], "zygote") == 0) {
+        if (zygote_start() < 0) {
+            perror("launcher: cannot start fork server");
+            return 1;
+        }
+        launcher = LAUNCH_ZYGOTE;
+    } else {
+        fprintf(stderr, "launcher: unknown backend %s\n", arglist[1]);
+        return 1;
     }
     return 0;
 }
 
+unsigned long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-int handle_pipe(char* cmdline) {
-    // Split the command based on the pipe '|'
-    char* commands[2];
-    char* token = strtok(cmdline, "|");
-    int index = 0;
+// Start of a span, or 0 when tracing is off so the span costs one branch
+unsigned long long trace_begin() {
+    return trace_on ? now_ns() : 0;
+}
 
-    while (token != NULL && index < 2) {
-        commands[index++] = token;
-        token = strtok(NULL, "|");
+// Record a span that started at start and ends now into this thread's ring
+void trace_span(const char* name, const char* detail, unsigned long long start, int pid, int stage) {
+    if (!trace_on || start == 0) return;
+    TraceRing* r = trace_ring;
+    if (r == NULL) {
+        r = calloc(1, sizeof(TraceRing));
+        r->tid = syscall(SYS_gettid);
+        r->next = atomic_load(&trace_rings);
+        while (!atomic_compare_exchange_weak(&trace_rings, &r->next, r));
+        trace_ring = r;
     }
-
-    if (index != 2) {
-        fprintf(stderr, "Invalid pipe command\n");
-        return -1;
+    unsigned long head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&r->tail, memory_order_acquire) == TRACE_RING) {
+        r->dropped++;
+        return;
     }
-
-    // Create a pipe
-    int pipefd[2];
-    if (pipe(pipefd) == -1) {
-        perror("pipe failed");
-        exit(1);
+    TraceEvent* e = &r->events[head & (TRACE_RING - 1)];
+    e->name = name;
+    e->start = start;
+    e->dur = now_ns() - start;
+    e->pid = pid;
+    e->stage = stage;
+    e->detail[0] = '\0';
+    if (detail != NULL) {
+        strncpy(e->detail, detail, TRACE_DETAIL - 1);
+        e->detail[TRACE_DETAIL - 1] = '\0';
     }
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
 
-    pid_t pid1 = fork();
-    if (pid1 == 0) {
-        // First child process - executes the first command
-        dup2(pipefd[1], STDOUT_FILENO); // Redirect stdout to pipe
-        close(pipefd[0]); // Close unused read end
-        close(pipefd[1]);
-
-        // Tokenize and execute the first command
-        char** arglist1 = tokenize(commands[0]);
-        if (arglist1 != NULL) {
-            execvp(arglist1[0], arglist1);
-            perror("Command not found...");
-            exit(1);
-        }
+void trace_write_out() {
+    size_t done = 0;
+    while (done < trace_len) {
+        ssize_t n = write(trace_fd, trace_buf + done, trace_len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += n;
     }
+    trace_len = 0;
+}
 
-    pid_t pid2 = fork();
-    if (pid2 == 0) {
-        // Second child process - executes the second command
-        dup2(pipefd[0], STDIN_FILENO); // Redirect stdin from pipe
-        close(pipefd[1]); // Close unused write end
-        close(pipefd[0]);
+// Append to the trace file's buffer. Raw write(2) is used rather than stdio
+// so a forked child never has trace output of its own to flush at exit.
+void trace_printf(const char* fmt, ...) {
+    if (trace_len > WRITE_BUFFER - 512) trace_write_out();
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(trace_buf + trace_len, WRITE_BUFFER - trace_len, fmt, ap);
+    va_end(ap);
+    if (n > 0) trace_len += (size_t)n < WRITE_BUFFER - trace_len ? (size_t)n : WRITE_BUFFER - trace_len - 1;
+}
 
-        // Tokenize and execute the second command
-        char** arglist2 = tokenize(commands[1]);
-        if (arglist2 != NULL) {
-            execvp(arglist2[0], arglist2);
-            perror("Command not found...");
-            exit(1);
+// Write everything buffered in the rings as Chrome trace events
+void trace_drain() {
+    for (TraceRing* r = atomic_load(&trace_rings); r != NULL; r = r->next) {
+        unsigned long tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        unsigned long head = atomic_load_explicit(&r->head, memory_order_acquire);
+        for (; tail != head; tail++) {
+            TraceEvent* e = &r->events[tail & (TRACE_RING - 1)];
+            // The detail is escaped for JSON; it is short, so this cannot overflow
+            char cmd[TRACE_DETAIL * 6 + 1];
+            size_t len = 0;
+            for (const char* p = e->detail; *p != '\0'; p++) {
+                if (*p == '"' || *p == '\\') cmd[len++] = '\\';
+                if ((unsigned char)*p < 0x20) len += sprintf(cmd + len, "\\u%04x", *p);
+                else cmd[len++] = *p;
+            }
+            cmd[len] = '\0';
+            trace_printf("%s{\"name\":\"%s\",\"cat\":\"shell\",\"ph\":\"X\",\"ts\":%.3f,"
+                         "\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"pid\":%d",
+                         trace_events++ ? ",\n" : "", e->name, (e->start - trace_epoch) / 1e3,
+                         e->dur / 1e3, (int)trace_pid, r->tid, e->pid > 0 ? e->pid : (int)trace_pid);
+            if (e->stage >= 0) trace_printf(",\"stage\":%d", e->stage);
+            if (len > 0) trace_printf(",\"cmd\":\"%s\"", cmd);
+            trace_printf("}}");
         }
+        atomic_store_explicit(&r->tail, tail, memory_order_release);
     }
+    trace_write_out();
+}
 
-    // Parent process closes pipe ends and waits for children
-    close(pipefd[0]);
-    close(pipefd[1]);
-    waitpid(pid1, NULL, 0);
-    waitpid(pid2, NULL, 0);
+// Flusher thread: drains the rings in the background until told to stop
+void* trace_flusher(void* arg) {
+    struct timespec pause = { 0, TRACE_FLUSH_MS * 1000000L };
+    while (!atomic_load(&trace_stopping)) {
+        trace_drain();
+        nanosleep(&pause, NULL);
+    }
+    return NULL;
+}
 
+// Begin writing a trace to path (see chrome://tracing or ui.perfetto.dev)
+int trace_start(const char* path) {
+    trace_stop();
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace_fd < 0) return -1;
+    trace_path = strdup(path);
+    trace_pid = getpid();
+    trace_epoch = now_ns();
+    trace_len = 0;
+    trace_printf("[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+                 "\"args\":{\"name\":\"myshell\"}}", (int)trace_pid);
+    trace_events = 1;
+    trace_write_out();
+    atomic_store(&trace_stopping, 0);
+    if (pthread_create(&trace_thread, NULL, trace_flusher, NULL) != 0) {
+        close(trace_fd);
+        trace_fd = -1;
+        return -1;
+    }
+    trace_on = 1;
     return 0;
 }
 
-
-void list_jobs() {
-    printf("Background jobs:\n");
-    for (int i = 0; i < job_count; i++) {
-        printf("[%d] %s (PID: %d)\n", i + 1, jobs[i].command, jobs[i].pid);
+// Stop tracing and finish the file. Only the shell that started the trace
+// does this; children that inherited it just stop recording.
+void trace_stop() {
+    if (trace_fd < 0 || getpid() != trace_pid) return;
+    trace_on = 0;
+    atomic_store(&trace_stopping, 1);
+    pthread_join(trace_thread, NULL);
+    trace_drain();
+    trace_printf("\n]\n");
+    trace_write_out();
+    close(trace_fd);
+    trace_fd = -1;
+    unsigned long dropped = 0;
+    for (TraceRing* r = atomic_load(&trace_rings); r != NULL; r = r->next) {
+        dropped += r->dropped;
+        r->dropped = 0;
     }
+    if (dropped > 0) fprintf(stderr, "trace: %lu events dropped\n", dropped);
+    free(trace_path);
+    trace_path = NULL;
 }
 
-void add_job(pid_t pid, char* command) {
-    if (job_count < MAX_JOBS) {
-        jobs[job_count].pid = pid;
-        strncpy(jobs[job_count].command, command, MAX_LEN);
-        job_count++;
+// Lists what Tab would complete the prefix to, one candidate per line
+int builtin_compgen(char** arglist) {
+    const char* kind = arglist[1];
+    const char* prefix = kind != NULL && arglist[2] != NULL ? arglist[2] : "";
+    Completions c = { NULL, 0, 0 };
+    if (kind != NULL && strcmp(kind, "-c") == 0) {
+        complete_commands(prefix, &c);
+    } else if (kind != NULL && strcmp(kind, "-f") == 0) {
+        complete_files(prefix, &c);
+    } else if (kind != NULL && strcmp(kind, "-v") == 0) {
+        complete_variables(prefix, &c);
     } else {
-        printf("Job list is full! Unable to add more background processes.\n");
+        fprintf(stderr, "compgen: usage: compgen -c|-f|-v [prefix]\n");
+        return 2;
     }
+    for (size_t i = 0; i < c.count; i++) {
+        const char* item = c.items[i] + (kind[1] == 'v');
+        size_t len = strlen(item);
+        if (item[len - 1] == ' ') len--;
+        out_write(item, len);
+        out_write("\n", 1);
+    }
+    return c.count > 0 ? 0 : 1;
 }
 
-void remove_job(pid_t pid) {
-    for (int i = 0; i < job_count; i++) {
-        if (jobs[i].pid == pid) {
-            // Shift remaining jobs down the list
-            for (int j = i; j < job_count - 1; j++) {
-                jobs[j] = jobs[j + 1];
-            }
-            job_count--;
-            break;
+// set -o trace-file=PATH starts tracing, set +o trace-file stops it, and
+// set -o alone shows the options
+int builtin_set(char** arglist) {
+    const char* usage = "set: usage: set [-o|+o] trace-file[=PATH] | noglob | globsort | "
+                        "joblog | joblog-size=BYTES[k|m|g]\n";
+    if (arglist[1] == NULL || (strcmp(arglist[1], "-o") == 0 && arglist[2] == NULL)) {
+        out_printf("trace-file\t%s\n", trace_path != NULL ? trace_path : "off");
+        out_printf("noglob\t\t%s\n", glob_off ? "on" : "off");
+        out_printf("globsort\t%s\n", glob_sort ? "on" : "off");
+        out_printf("joblog\t\t%s\n", joblog_on ? "on" : "off");
+        out_printf("joblog-size\t%zu\n", joblog_size);
+        return 0;
+    }
+    int on = strcmp(arglist[1], "-o") == 0;
+    if ((!on && strcmp(arglist[1], "+o") != 0) || arglist[2] == NULL) {
+        fputs(usage, stderr);
+        return 2;
+    }
+    if (strcmp(arglist[2], "noglob") == 0) {
+        glob_off = on;
+        return 0;
+    }
+    if (strcmp(arglist[2], "globsort") == 0) {
+        glob_sort = on;
+        return 0;
+    }
+    if (strcmp(arglist[2], "joblog") == 0) {
+        joblog_on = on;
+        return 0;
+    }
+    if (strncmp(arglist[2], "joblog-size", 11) == 0) {
+        // Applies to jobs started from now on; +o goes back to the default
+        if (!on) {
+            joblog_size = JOBLOG_SIZE;
+            return 0;
+        }
+        const char* value = arglist[2][11] == '=' ? arglist[2] + 12 : arglist[3];
+        char* end = NULL;
+        unsigned long long size = value != NULL ? strtoull(value, &end, 10) : 0;
+        int shift = end == NULL ? 0 : *end == 'k' || *end == 'K' ? 10 : *end == 'm' || *end == 'M' ? 20
+                    : *end == 'g' || *end == 'G' ? 30 : 0;
+        if (end != NULL && shift > 0) end++;
+        if (end == NULL || end == value || *end != '\0' || size == 0 || size > (1ULL << 40) >> shift) {
+            fputs(usage, stderr);
+            return 2;
         }
+        joblog_size = size << shift;
+        if (joblog_size < 4096) joblog_size = 4096;
+        return 0;
+    }
+    if (strncmp(arglist[2], "trace-file", 10) != 0) {
+        fputs(usage, stderr);
+        return 2;
+    }
+    if (!on) {
+        trace_stop();
+        return 0;
+    }
+    const char* path = arglist[2][10] == '=' ? arglist[2] + 11 : arglist[3];
+    if (path == NULL) {
+        fputs(usage, stderr);
+        return 2;
+    }
+    if (path[0] == '\0') {
+        trace_stop();
+        return 0;
     }
+    if (trace_start(path) < 0) {
+        fprintf(stderr, "set: %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+// Sum the times of a reaped foreground child into child_usage; RSS is a peak
+void add_child_usage(const struct rusage* ru) {
+    timeradd(&child_usage.ru_utime, &ru->ru_utime, &child_usage.ru_utime);
+    timeradd(&child_usage.ru_stime, &ru->ru_stime, &child_usage.ru_stime);
+    if (ru->ru_maxrss > child_usage.ru_maxrss) child_usage.ru_maxrss = ru->ru_maxrss;
 }
 
+unsigned hist_bucket(unsigned long long v) {
+    if (v < (1 << HIST_SUB_BITS)) return v;
+    int e = 63 - __builtin_clzll(v);
+    return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+           ((v >> (e - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
 
-// Function to get the value of a user-defined variable
-char* get_variable_value(const char* name) {
-    for (int i = 0; i < variable_count; i++) {
-        if (strcmp(variables[i].name, name) == 0) {
-            return variables[i].value;
+// Highest value that lands in bucket i
+unsigned long long hist_value(unsigned i) {
+    if (i < (1 << HIST_SUB_BITS)) return i;
+    int e = (i >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    unsigned long long sub = i & ((1 << HIST_SUB_BITS) - 1);
+    unsigned long long step = 1ULL << (e - HIST_SUB_BITS);
+    return (((1ULL << HIST_SUB_BITS) + sub) << (e - HIST_SUB_BITS)) + step - 1;
+}
+
+CmdStats* stats_find(const char* name, int create) {
+    unsigned long h = hash_string(name);
+    if (cmd_stats_cap > 0) {
+        for (size_t i = h & (cmd_stats_cap - 1); cmd_stats[i].name != NULL;
+             i = (i + 1) & (cmd_stats_cap - 1)) {
+            if (cmd_stats[i].hash == h && strcmp(cmd_stats[i].name, name) == 0) return &cmd_stats[i];
         }
     }
-    return NULL; // Return NULL if variable is not found
-}
+    if (!create) return NULL;
 
-// Function to set or update the value of a user-defined variable
-void set_variable(const char* name, const char* value) {
-    // Check if the variable already exists and update it if so
-    for (int i = 0; i < variable_count; i++) {
-        if (strcmp(variables[i].name, name) == 0) {
-            strncpy(variables[i].value, value, MAX_LEN);
-            return;
+    // Keep the table at most half full
+    if ((cmd_stats_count + 1) * 2 > cmd_stats_cap) {
+        size_t old_cap = cmd_stats_cap;
+        CmdStats* old = cmd_stats;
+        cmd_stats_cap = old_cap ? old_cap * 2 : 32;
+        cmd_stats = calloc(cmd_stats_cap, sizeof(CmdStats));
+        for (size_t i = 0; i < old_cap; i++) {
+            if (old[i].name == NULL) continue;
+            size_t j = old[i].hash & (cmd_stats_cap - 1);
+            while (cmd_stats[j].name != NULL) j = (j + 1) & (cmd_stats_cap - 1);
+            cmd_stats[j] = old[i];
         }
+        free(old);
     }
-    
-    // Add a new variable if it doesn't exist
-    if (variable_count < MAX_VARIABLES) {
-        strncpy(variables[variable_count].name, name, ARGLEN);
-        strncpy(variables[variable_count].value, value, MAX_LEN);
-        variable_count++;
-    } else {
-        fprintf(stderr, "Error: Maximum variable limit reached.\n");
-    }
-}
-
-int handle_variable(char* cmdline) {
-    // Check for assignment (e.g., var=value)
-    char* equal_sign = strchr(cmdline, '=');
-    if (equal_sign != NULL) {
-        *equal_sign = '\0';
-        char* name = cmdline;
-        char* value = equal_sign + 1;
-        trim_whitespace(name);
-        trim_whitespace(value);
-        set_variable(name, value);
-        return 1; // Indicate that we handled a variable assignment
-    }
-
-    // Check if the command is an `echo` command with a variable
-    if (strncmp(cmdline, "echo ", 5) == 0) {
-        char* varname = cmdline + 5; // Get the part after "echo "
-        
-        // If the variable name starts with $, retrieve its value
-        if (varname[0] == '$') {
-            char* var_value = get_variable_value(varname + 1); // Skip the '$'
-            if (var_value) {
-                printf("%s\n", var_value);
-            } else {
-                printf("Variable not found: %s\n", varname + 1);
-            }
-        } else {
-            // No variable, just print as normal echo
-            printf("%s\n", varname);
+    size_t i = h & (cmd_stats_cap - 1);
+    while (cmd_stats[i].name != NULL) i = (i + 1) & (cmd_stats_cap - 1);
+    cmd_stats[i].name = strdup(name);
+    cmd_stats[i].hash = h;
+    cmd_stats[i].buckets = calloc(HIST_BUCKETS, sizeof(unsigned long long));
+    cmd_stats_count++;
+    return &cmd_stats[i];
+}
+
+// Add one run of a command to its histogram: a lookup and an increment
+void stats_record(const char* name, unsigned long long ns) {
+    CmdStats* st = stats_find(name, 1);
+    st->count++;
+    st->total += ns;
+    if (ns > st->max) st->max = ns;
+    st->buckets[hist_bucket(ns)]++;
+}
+
+unsigned long long stats_percentile(const CmdStats* st, double q) {
+    unsigned long long want = (unsigned long long)(q * st->count + 0.5), seen = 0;
+    if (want == 0) want = 1;
+    for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+        seen += st->buckets[i];
+        if (seen >= want) {
+            unsigned long long v = hist_value(i);
+            return v < st->max ? v : st->max;
         }
-        return 1; // Indicate that we handled a variable retrieval
     }
+    return st->max;
+}
+
+void format_duration(char* buf, size_t size, unsigned long long ns) {
+    if (ns < 1000) snprintf(buf, size, "%lluns", ns);
+    else if (ns < 1000000) snprintf(buf, size, "%.1fus", ns / 1e3);
+    else if (ns < 1000000000) snprintf(buf, size, "%.1fms", ns / 1e6);
+    else snprintf(buf, size, "%.2fs", ns / 1e9);
+}
 
-    return 0; // Indicate that no variable handling was needed
+int compare_stats(const void* a, const void* b) {
+    const CmdStats* x = *(CmdStats* const*)a;
+    const CmdStats* y = *(CmdStats* const*)b;
+    if (x->count != y->count) return x->count < y->count ? 1 : -1;
+    return strcmp(x->name, y->name);
 }
 
+// stats [-r] [name...]: latency per command name, most frequent first
+int builtin_stats(char** arglist) {
+    if (arglist[1] != NULL && strcmp(arglist[1], "-r") == 0) {
+        for (size_t i = 0; i < cmd_stats_cap; i++) {
+            free(cmd_stats[i].name);
+            free(cmd_stats[i].buckets);
+        }
+        free(cmd_stats);
+        cmd_stats = NULL;
+        cmd_stats_cap = 0;
+        cmd_stats_count = 0;
+        return 0;
+    }
+    CmdStats** rows = arena_alloc(&cmd_arena, sizeof(CmdStats*) * (cmd_stats_count + 1));
+    size_t n = 0;
+    if (arglist[1] != NULL) {
+        for (int i = 1; arglist[i] != NULL; i++) {
+            CmdStats* st = stats_find(arglist[i], 0);
+            if (st != NULL && n < cmd_stats_count) rows[n++] = st;
+        }
+    } else {
+        for (size_t i = 0; i < cmd_stats_cap; i++) {
+            if (cmd_stats[i].name != NULL) rows[n++] = &cmd_stats[i];
+        }
+        qsort(rows, n, sizeof(CmdStats*), compare_stats);
+    }
+    out_printf("%-24s %8s %10s %10s %10s %10s\n", "command", "count", "mean", "p50", "p99", "max");
+    for (size_t i = 0; i < n; i++) {
+        char mean[32], p50[32], p99[32], max[32];
+        format_duration(mean, sizeof(mean), rows[i]->total / rows[i]->count);
+        format_duration(p50, sizeof(p50), stats_percentile(rows[i], 0.50));
+        format_duration(p99, sizeof(p99), stats_percentile(rows[i], 0.99));
+        format_duration(max, sizeof(max), rows[i]->max);
+        out_printf("%-24s %8lu %10s %10s %10s %10s\n", rows[i]->name, rows[i]->count, mean, p50,
+                   p99, max);
+    }
+    return 0;
+}
 
+int builtin_hash(char** arglist) {
+    if (arglist[1] == NULL) {
+        path_cache_list();
+        return 0;
+    }
+    if (strcmp(arglist[1], "-r") == 0) {
+        path_cache_clear();
+        path_hits = 0;
+        path_misses = 0;
+        return 0;
+    }
+    int status = 0;
+    for (int i = 1; arglist[i] != NULL; i++) {
+        if (lookup_command(arglist[i]) == NULL) {
+            fprintf(stderr, "hash: %s: not found\n", arglist[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
 
-void list_user_variables() {
-    printf("User-defined variables:\n");
-    for (int i = 0; i < variable_count; i++) {
-        printf("%s=%s\n", variables[i].name, variables[i].value);
+// Copy a finished item's captured output to stdout
+void parallel_emit(int fd) {
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size > 0) {
+        char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            out_write(data, size);
+            munmap(data, size);
+        }
     }
+    close(fd);
 }
 
-int execute_builtin(char** arglist) {
-    if (strcmp(arglist[0], "cd") == 0) {
-        if (arglist[1] != NULL) {
-            if (chdir(arglist[1]) != 0) {
-                perror("cd failed");
-            }
+// parallel: run a command once per item while keeping exactly N children
+// alive. Children are started through launch_process() like any other
+// command and reaped with wait4(), which also gives their CPU time; other
+// children that exit meanwhile (background jobs) are handed to the job table.
+// With -k each item's output is captured in a memfd and printed whole, in
+// input order. Returns the number of failed items, at most 101.
+int builtin_parallel(char** arglist) {
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int keep = 0, quiet = 0, i = 1;
+    for (; arglist[i] != NULL && arglist[i][0] == '-'; i++) {
+        if (strcmp(arglist[i], "-k") == 0) {
+            keep = 1;
+        } else if (strcmp(arglist[i], "-q") == 0) {
+            quiet = 1;
+        } else if (strcmp(arglist[i], "-j") == 0 && arglist[i + 1] != NULL) {
+            jobs = atol(arglist[++i]);
+        } else if (strncmp(arglist[i], "-j", 2) == 0 && arglist[i][2] != '\0') {
+            jobs = atol(arglist[i] + 2);
         } else {
-            fprintf(stderr, "cd: missing argument\n");
+            break;
         }
-        return 1;
     }
-    if (strcmp(arglist[0], "exit") == 0) {
-        printf("Exiting shell...\n");
-        exit(0);
+    if (jobs < 1) jobs = 1;
+    char** cmd = arglist + i;
+    int cmdlen = 0;
+    while (cmd[cmdlen] != NULL && strcmp(cmd[cmdlen], ":::") != 0) cmdlen++;
+    if (cmdlen == 0) {
+        fprintf(stderr, "parallel: missing command\n");
+        return 2;
     }
-    if (strcmp(arglist[0], "jobs") == 0) {
-        list_jobs();
-        return 1;
+
+    // Collect the items: after :::, or one per line of stdin
+    char** items;
+    size_t nitems = 0;
+    if (cmd[cmdlen] != NULL) {
+        items = cmd + cmdlen + 1;
+        while (items[nitems] != NULL) nitems++;
+    } else {
+        size_t cap = 256;
+        items = arena_alloc(&cmd_arena, sizeof(char*) * cap);
+        LineReader own = { 0 };
+        LineReader* r = &stdin_reader;
+        if (stdin_redirected || stdin_reader.buf == NULL) {
+            reader_init(&own, STDIN_FILENO);
+            r = &own;
+        }
+        out_flush();
+        char* line;
+        size_t len;
+        while ((line = reader_next_line(r, &len)) != NULL) {
+            if (len == 0) continue;
+            if (nitems == cap) {
+                char** bigger = arena_alloc(&cmd_arena, sizeof(char*) * cap * 2);
+                memcpy(bigger, items, sizeof(char*) * cap);
+                items = bigger;
+                cap *= 2;
+            }
+            items[nitems++] = arena_strndup(&cmd_arena, line, len);
+        }
+        free(own.buf);
     }
-    if (strcmp(arglist[0], "kill") == 0) {
-        if (arglist[1] != NULL) {
-            pid_t pid = atoi(arglist[1]);
-            if (kill(pid, SIGKILL) == 0) {
-                printf("Process %d killed.\n", pid);
-            } else {
-                perror("Failed to kill process");
+    if ((size_t)jobs > nitems && nitems > 0) jobs = nitems;
+
+    // Children get no terminal input; their stdin is /dev/null
+    int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    ParallelSlot* slots = arena_alloc(&cmd_arena, sizeof(ParallelSlot) * jobs);
+    memset(slots, 0, sizeof(ParallelSlot) * jobs);
+    int* captured = NULL;  // -k: memfd per item, -1 once printed
+    if (keep) {
+        captured = arena_alloc(&cmd_arena, sizeof(int) * (nitems + 1));
+        for (size_t k = 0; k < nitems; k++) captured[k] = -1;
+    }
+    char* done = arena_alloc(&cmd_arena, nitems + 1);
+    memset(done, 0, nitems + 1);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    double cpu = 0;
+    size_t next = 0, emitted = 0, failed = 0;
+    long running = 0;
+    while (next < nitems || running > 0) {
+        // Fill every free slot
+        for (long s = 0; s < jobs && next < nitems; s++) {
+            if (slots[s].pid != 0) continue;
+            size_t item = next++;
+            ArenaMark mark = arena_mark(&cmd_arena);
+            char** argv = arena_alloc(&cmd_arena, sizeof(char*) * (cmdlen + 2));
+            int placed = 0;
+            for (int k = 0; k < cmdlen; k++) {
+                char* brace = strstr(cmd[k], "{}");
+                if (brace == NULL) {
+                    argv[k] = cmd[k];
+                    continue;
+                }
+                size_t pre = brace - cmd[k], ilen = strlen(items[item]);
+                argv[k] = arena_alloc(&cmd_arena, strlen(cmd[k]) + ilen - 1);
+                memcpy(argv[k], cmd[k], pre);
+                memcpy(argv[k] + pre, items[item], ilen);
+                strcpy(argv[k] + pre + ilen, brace + 2);
+                placed = 1;
             }
-        } else {
-            fprintf(stderr, "kill: missing PID\n");
+            argv[cmdlen] = placed ? NULL : items[item];
+            argv[cmdlen + 1] = NULL;
+
+            Launch l = { argv, NULL, NULL, null_fd, -1, -1, 0, 0 };
+            if (keep) {
+                captured[item] = memfd_create("parallel", MFD_CLOEXEC);
+                l.out_fd = captured[item];
+            }
+            pid_t pid = launch_process(&l);
+            arena_release(&cmd_arena, mark);
+            if (pid < 0) {
+                failed++;
+                done[item] = 1;
+                s--;  // try the slot again with the next item
+                continue;
+            }
+            slots[s].pid = pid;
+            slots[s].item = item;
+            running++;
         }
-        return 1;
+
+        // Print grouped output as soon as everything before it is out
+        while (keep && emitted < nitems && done[emitted]) {
+            if (captured[emitted] >= 0) parallel_emit(captured[emitted]);
+            emitted++;
+        }
+        if (running == 0) continue;
+
+        int status;
+        struct rusage ru;
+        pid_t pid = wait4(-1, &status, 0, &ru);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        long s = 0;
+        while (s < jobs && slots[s].pid != pid) s++;
+        if (s == jobs) {
+            JobProc* proc = find_job_proc(pid);
+            if (proc != NULL) job_proc_exited(proc, status);
+            continue;
+        }
+        cpu += ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+               ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed++;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 127) path_cache_forget(cmd[0]);
+        done[slots[s].item] = 1;
+        slots[s].pid = 0;
+        running--;
     }
-    if (strcmp(arglist[0], "help") == 0) {
-        printf("Available built-in commands:\n");
-        printf("cd <directory> - Change the working directory.\n");
-        printf("exit - Terminate the shell.\n");
-        printf("jobs - List background processes.\n");
-        printf("kill <PID> - Terminate a background process by PID.\n");
-        printf("listvars - Display user-defined variables.\n");
-        printf("printenv - Display environment variables.\n");
-        printf("help - Display this help message.\n");
-        return 1;
+    while (keep && emitted < nitems) {
+        if (captured[emitted] >= 0) parallel_emit(captured[emitted]);
+        emitted++;
     }
-    if (strcmp(arglist[0], "listvars") == 0) {
-        list_user_variables();
-        return 1;
+    if (null_fd >= 0) close(null_fd);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double wall = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (!quiet) {
+        out_flush();
+        fprintf(stderr, "parallel: %zu items, %ld at a time, %zu failed, %.3f s wall, "
+                "%.3f s CPU, %.0f%% CPU\n", nitems, jobs, failed, wall, cpu,
+                wall > 0 ? cpu * 100 / wall : 0);
     }
-    if (strcmp(arglist[0], "printenv") == 0) {
-        system("printenv");
-        return 1;
+    return failed > 101 ? 101 : (int)failed;
+}
+
+// Every builtin, in the order help lists them
+const Builtin builtins[] = {
+    { "cd", builtin_cd, BUILTIN_PARENT, "cd <directory>", "Change the working directory." },
+    { "exit", builtin_exit, BUILTIN_PARENT, "exit [status]", "Terminate the shell." },
+    { "jobs", builtin_jobs, BUILTIN_PIPE, "jobs [-l]",
+      "List background processes; -l adds their PIDs and placement." },
+    { "run", builtin_run, BUILTIN_PARENT, "run [--cpus LIST] [--nice N] [--sched POLICY] [--io CLASS] cmd|%job",
+      "Start cmd, or move a running job, onto CPUs, a scheduling policy, nice value and I/O class." },
+    { "kill", builtin_kill, BUILTIN_PIPE, "kill <PID|%job>",
+      "Terminate a background process by PID, or a whole job." },
+    { "wait", builtin_wait, BUILTIN_PARENT, "wait [-n] [-t seconds] [PID|%job...]",
+      "Wait for jobs (all, the named ones, or with -n the first); 124 if the timeout expires." },
+    { "joblog", builtin_joblog, BUILTIN_PARENT | BUILTIN_PIPE, "joblog [-d] [%job|PID]",
+      "List captured background output (set -o joblog), print one job's, or discard it." },
+    { "listvars", builtin_listvars, BUILTIN_PIPE, "listvars", "Display user-defined variables." },
+    { "printenv", builtin_printenv, BUILTIN_PIPE, "printenv [name...]",
+      "Display environment variables, or the values of the named ones." },
+    { "export", builtin_export, BUILTIN_PARENT | BUILTIN_PIPE, "export [name[=value]...]",
+      "Pass variables to the commands the shell starts; alone, list them." },
+    { "unset", builtin_unset, BUILTIN_PARENT, "unset name...", "Remove variables, from the environment too." },
+    { "echo", builtin_echo, BUILTIN_PIPE, "echo [-n] [arg...]", "Print the arguments." },
+    { "printf", builtin_printf, BUILTIN_PIPE, "printf format [arg...]",
+      "Print the arguments under control of the format." },
+    { "test", builtin_test, BUILTIN_PIPE, "test expr", "Evaluate a file, string or number test." },
+    { "[", builtin_test, BUILTIN_PIPE, "[ expr ]", "Same as test." },
+    { "true", builtin_true, BUILTIN_PIPE, "true", "Return success." },
+    { "false", builtin_false, BUILTIN_PIPE, "false", "Return failure." },
+    { "pwd", builtin_pwd, BUILTIN_PIPE, "pwd", "Print the working directory." },
+    { "read", builtin_read, BUILTIN_PARENT | BUILTIN_PIPE, "read [-r] [name...]",
+      "Read a line from stdin into variables (REPLY if none are named)." },
+    { "launcher", builtin_launcher, BUILTIN_PARENT, "launcher [fork|spawn|zygote]",
+      "Show or select how external commands are started." },
+    { "hash", builtin_hash, BUILTIN_PARENT | BUILTIN_PIPE, "hash [-r] [name...]",
+      "Show, clear or fill the command path cache." },
+    { "history", builtin_history, BUILTIN_PIPE, "history [n] | -s text | -p prefix",
+      "List the last n commands, or search them like Ctrl-R / the inline suggestion." },
+    { "source", builtin_source, BUILTIN_PARENT, "source <file>",
+      "Run a script in this shell; unchanged files are not parsed again." },
+    { ".", builtin_source, BUILTIN_PARENT, ". <file>", "Same as source." },
+    { "parallel", builtin_parallel, BUILTIN_PIPE, "parallel [-j N] [-k] [-q] cmd [arg...] [::: item...]",
+      "Run cmd once per item (stdin lines if no :::), N at a time; {} marks where the item goes." },
+    { "stats", builtin_stats, BUILTIN_PARENT | BUILTIN_PIPE, "stats [-r] [name...]",
+      "Show count, mean, p50, p99 and max latency per command name; -r clears them." },
+    { "set", builtin_set, BUILTIN_PARENT, "set [-o|+o] trace-file[=PATH] | noglob | globsort | joblog | joblog-size=N",
+      "Write a Chrome/Perfetto trace of shell spans; turn globbing or sorting of its matches off; capture background output." },
+    { "compgen", builtin_compgen, BUILTIN_PARENT | BUILTIN_PIPE, "compgen -c|-f|-v [prefix]",
+      "List what Tab completes prefix to: commands, file names or variables." },
+    { "help", builtin_help, BUILTIN_PIPE, "help", "Display this help message." },
+    { NULL, NULL, 0, NULL, NULL }
+};
+
+int builtin_help(char** arglist) {
+    out_printf("Available built-in commands:\n");
+    for (const Builtin* b = builtins; b->name != NULL; b++) {
+        out_printf("%s - %s\n", b->usage, b->help);
     }
     return 0;
 }
 
+// Open-addressed index over builtins[], keyed on length, first and last
+// byte. It is filled once, so a lookup is one hash and (almost always) a
+// single strcmp, however many builtins are registered.
+const Builtin* builtin_index[BUILTIN_SLOTS];
+int builtin_index_ready = 0;
+
+unsigned builtin_slot(const char* name, size_t len) {
+    return (len * 31 + (unsigned char)name[0] * 7 + (unsigned char)name[len - 1]) &
+           (BUILTIN_SLOTS - 1);
+}
+
+const Builtin* find_builtin(const char* name) {
+    if (!builtin_index_ready) {
+        for (const Builtin* b = builtins; b->name != NULL; b++) {
+            unsigned i = builtin_slot(b->name, strlen(b->name));
+            while (builtin_index[i] != NULL) i = (i + 1) & (BUILTIN_SLOTS - 1);
+            builtin_index[i] = b;
+        }
+        builtin_index_ready = 1;
+    }
+    size_t len = strlen(name);
+    if (len == 0) return NULL;
+    for (unsigned i = builtin_slot(name, len); builtin_index[i] != NULL;
+         i = (i + 1) & (BUILTIN_SLOTS - 1)) {
+        const Builtin* b = builtin_index[i];
+        if (strcmp(b->name, name) == 0) return b;
+    }
+    return NULL;
+}
+
+int is_builtin(const char* name) {
+    return find_builtin(name) != NULL;
+}
+
+// Run arglist if it names a builtin. Returns 1 if it did, 0 otherwise.
+int execute_builtin(char** arglist) {
+    const Builtin* b = find_builtin(arglist[0]);
+    if (b == NULL) return 0;
+    unsigned long long start = trace_begin();
+    last_status = b->fn(arglist);
+    trace_span("builtin", arglist[0], start, 0, -1);
+    return 1;
+}